@@ -4,6 +4,130 @@
 
 #include "bfs.h"
 
+Geometry g_geo = {DEFBYTESPERBLOCK, DEFBLOCKSPERDISK, DEFNUMINODES,
+                  1, 1, 2, 1, 3, 1,
+                  1, sizeof(Inode1), sizeof(i16),
+                  NUMDIRECT + DEFBYTESPERBLOCK / sizeof(i16)}; // original disk
+
+OFTE g_oft[NUMOFTENTRIES]; // Open File Table
+
+static Inode *g_inodes = NULL;   // resident copy of the Inodes blocks
+static i8 *g_inodeDirty = NULL;  // per Inodes block: 1 => needs writing back
+
+static Super g_super;            // resident copy of the SuperBlock
+static u64 *g_bitmap = NULL;     // free-space bitmap: 1 => in use
+static i8 *g_bitmapDirty = NULL; // per bitmap block: 1 => needs writing
+static i32 g_allocHint; // DBN where the next search for a free block starts
+static i32 g_numFree;   // # of free blocks in the bitmap
+static i32 *g_freeLink = NULL; // Freelist disk: per block, the next DBN its
+                               // Freelist link holds on disk.  -1 => unknown
+
+static DirEnt *g_dir = NULL;      // resident copy of the Dir blocks
+static i32 *g_dirHash = NULL;     // fname -> inum, open addressed.  -1 => empty
+static i32 g_dirHashMask;         // # of slots in g_dirHash, less 1
+static u64 *g_inodeMap = NULL;    // free-inode bitmap: 1 => inum in use
+static i32 g_inodeHint;           // word of g_inodeMap where searches start
+static i32 g_numFreeInums;        // # of free inums in g_inodeMap
+
+typedef struct
+{                        // Dentry: result of looking up 'fname' in 'dir'
+  i32 dir;               // inum of the directory.  -1 => slot unused
+  i32 inum;              // file found.  EFNF => 'fname' is not in 'dir'
+  u32 used;              // value of g_dcacheClock when last used
+  char fname[FNAMESIZE]; // name looked up
+} Dentry;
+
+static Dentry g_dcache[NUMDCACHE]; // lookups in subdirectories, hash-indexed
+static u32 g_dcacheClock;          // ticks on every use of g_dcache
+
+// Locks.  Operations on file data hold g_fsLock shared, plus the lock of the
+// file's OFTE: shared to read, exclusive to write.  Operations that may move
+// the resident tables - creating files and directories, lookups, mount,
+// sync - hold g_fsLock exclusively, and so need no other lock.  Beneath those,
+// g_oftLock guards the OFT and FD tables, and g_allocLock guards the
+// free-space bitmap, the indirect tables in g_maps and the loading of an
+// OFTE's block map.  Locks are taken in that order; bio.c locks come last.
+// Once loaded, an OFTE's block map is read without a lock: it changes only
+// while the file's lock is held for writing
+
+static pthread_rwlock_t g_fsLock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t g_oftLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t g_allocLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Free slots in the OFT and the FD table are on a freelist, except for those
+// never used yet: every slot from the table's high-water mark on
+
+static FDE g_fdt[NUMFDS];      // File Descriptor table.  FD 'fd' is slot fd - FDBASE
+static i32 g_fdFree = -1;      // first free FDE.  -1 => none
+static i32 g_fdHigh = 0;       // FDEs from here on have never been used
+static i32 g_oftFree = -1;     // first free OFTE.  -1 => none
+static i32 g_oftHigh = 0;      // OFTEs from here on have never been used
+static i32 *g_inumOfte = NULL; // per inum: index of its OFTE.  -1 => not open
+
+typedef struct
+{             // Indirect table, decoded and held in memory
+  i32 dbn;    // block holding the table.  0 => slot unused
+  i32 dirty;  // 1 => changed since written to the block cache
+  u32 used;   // value of g_mapClock when last used
+  i32 *table; // NUMINDIRECT DBNs
+} MapBlock;
+
+static MapBlock g_maps[NUMMAPCACHE]; // indirect tables of any depth
+static u32 g_mapClock;               // ticks on every use of g_maps
+
+typedef struct
+{              // Runs of blocks gathered by bfsTruncate
+  Extent *run; // 'dbn' and 'len' of each run.  'fbn' too, for Extents
+  i32 num;     // # of runs
+  i32 max;     // room in 'run'
+} RunList;
+
+static Dentry *bfsDentryFind(i32 dir, str fname, Dentry **victim);
+static i32 bfsAllocInum();
+static i8 *bfsDelayFind(OFTE *e, i32 fbn);
+static i32 bfsChunkBase();
+static i32 bfsChunkOf(i32 inum, i32 *first);
+static int bfsCmpRun(const void *a, const void *b);
+static i32 bfsDirFind(str fname);
+static i32 bfsDirIndex();
+static i32 bfsDirInsert(i32 inum);
+static i32 bfsDirRemove(i32 inum);
+static u32 bfsDirHashName(str fname);
+static i32 bfsDirLookup(i32 dir, str fname);
+static i32 bfsExtentFind(Extent *list, i32 count, i32 fbn);
+static FDE *bfsFde(i32 fd);
+static i32 bfsExtentPut(Extent *list, i32 *count, i32 max, Extent *e);
+static i32 bfsExtentGather(i32 node, RunList *keep, RunList *gone);
+static i32 bfsExtentSet(Inode *inode, i32 fbn, i32 dbn, i32 len);
+static i32 bfsExtentTrunc(Inode *inode, i32 keep, RunList *gone);
+static i32 bfsExtentWalk(Inode *inode, i32 fbn);
+static i32 bfsExtentWritten(Inode *inode, i32 fbn);
+static i32 bfsFreeRuns(RunList *gone);
+static i32 bfsGrowInodes();
+static i32 bfsInitMapping(i32 inum);
+static i32 bfsLinkAdd(i32 dir, str fname, i32 inum);
+static i32 bfsLinkFind(i32 dir, str fname);
+static i32 bfsLinkRemove(i32 dir, i32 inum);
+static i32 bfsLoadMap(i32 ofte);
+static i32 bfsMapDirty(i32 dbn);
+static i32 bfsMapDrop(i32 dbn);
+static i32 bfsMapFlush();
+static i32 bfsMapForget(OFTE *e);
+static i32 bfsMapMissing(Inode *inode, i32 fbn, i64 *seen);
+static i32 *bfsMapSegment(OFTE *e, i32 fbn);
+static i32 bfsMapSet(Inode *inode, i32 fbn, i32 dbn);
+static i32 bfsMapTrunc(i32 *slot, i32 depth, i64 base, i32 keep,
+                       RunList *gone);
+static i32 *bfsMapSlot(OFTE *e, i32 fbn);
+static i32 *bfsMapTable(i32 dbn, i32 fresh);
+static i32 bfsMapWalk(Inode *inode, i32 fbn);
+static i32 bfsMapWritten(Inode *inode, i32 fbn);
+static i32 bfsNewFile(i32 dir, str fname, i32 flags);
+static i32 bfsReadaheadRun(FDE *e, i64 pos, i64 end);
+static i32 bfsRunAdd(RunList *rl, i32 fbn, i32 dbn, i32 len);
+static i32 bfsOpenOFTE(i32 inum);
+static i32 bfsWalkPath(str path, i32 *dir, str fname);
+
 // ============================================================================
 // Allocate a free disk block for the file whose Inode number is 'inum' and
 // assign it to FBN 'fbn' in the file's Inode.  On success, return the DBN
@@ -18,466 +142,3065 @@ i32 bfsAllocBlock(i32 inum, i32 fbn)
     FATAL(EBADINUM);
   if (fbn < 0)
     FATAL(EBADFBN);
-  if (fbn > MAXFBN)
+  if (fbn >= MAXFBN)
     FATAL(EBADFBN);
 
   // Grab the next free block in the BFS disk
 
+  pthread_mutex_lock(&g_allocLock);
   i32 dbn = bfsFindFreeBlock();
 
-  // Update the corresponding Inode, or IndirectBlock
-
-  i8 buf8[BYTESPERBLOCK] = {0}; // 1-block buffer
-  bioRead(DBNINODES, buf8);
+  // Update the corresponding Inode, or indirect tables
 
-  Inode *pinodes = (Inode *)buf8; // array of Inodes
-  Inode *pinode = &pinodes[inum]; // target Inode
-
-  if (fbn < NUMDIRECT)
-  { // in direct[] array?
-    pinode->direct[fbn] = dbn;
-    bioWrite(DBNINODES, buf8);
-    return dbn;
-  }
-  else
-  { // in indirect block?
-    i16 buf16[I16SPERBLOCK] = {0};
-    i32 dbnIndirect = pinode->indirect; // DBN of indirect block
+  Inode inode;
+  bfsReadInode(inum, &inode);
+  bfsMapSet(&inode, fbn, dbn);
+  bfsWriteInode(inum, &inode);
+  bfsMapFlush();
 
-    if (dbnIndirect == 0)
-    { // not yet allocated
-      dbnIndirect = bfsFindFreeBlock();
-      pinode->indirect = dbnIndirect;
-    }
+  // Keep the block map of the open file in step
 
-    bioRead(dbnIndirect, buf16);
-    buf16[fbn - NUMDIRECT] = dbn;
-    bioWrite(dbnIndirect, buf16);
-    bioWrite(DBNINODES, buf8);
-  }
+  i32 ofte = bfsOpenOFTE(inum);
+  i32 *slot = (ofte < 0) ? NULL : bfsMapSlot(&g_oft[ofte], fbn);
+  if (slot != NULL)
+    *slot = dbn;
 
+  pthread_mutex_unlock(&g_allocLock);
   return dbn; // allocated DBN
 }
 
 // ============================================================================
-// Create file 'fname'.  Find a free inum; ie, free slot in the Directory.
-// Leave the size of the file as zero, until the user performs a write, or a
-// seek into the file.  On success, return the file's inum.  On failure, abort
+// Allocate disk blocks for every FBN from 'fbnFirst' to 'fbnLast' (inclusive)
+// of file 'inum' that is not yet mapped.  The data blocks are reserved in as
+// few contiguous runs as the free space allows, and any indirect tables they
+// need are allocated as they are reached.  Then the Inode, and each indirect
+// table changed, are updated once.  The new data blocks are not initialized:
+// the caller writes, or zeroes, them - unless 'unwritten' is set, for an
+// extent Inode, which maps them with EXTENTUNWRITTEN, so they read as zeros.
+// Otherwise, FBNs in the range reserved that way are marked written.  On
+// success, return the number of data blocks allocated.  On failure, abort
 // ============================================================================
-i32 bfsCreateFile(str fname)
+i32 bfsAllocRange(i32 inum, i32 fbnFirst, i32 fbnLast, i32 unwritten)
 {
 
-  if (fname == NULL)
-    FATAL(ENULLPTR);
+  if (inum < 0)
+    FATAL(EBADINUM);
+  if (inum > MAXINUM)
+    FATAL(EBADINUM);
+  if (fbnFirst < 0)
+    FATAL(EBADFBN);
+  if (fbnLast >= MAXFBN)
+    FATAL(EBADFBN);
 
-  if (strlen(fname) > FNAMESIZE - 1)
-    FATAL(EBIGFNAME); // fname too big
+  pthread_mutex_lock(&g_allocLock);
+  Inode inode;
+  bfsReadInode(inum, &inode);
 
-  i8 buf[BYTESPERBLOCK] = {0};
+  // Count the FBNs that still need a block, and the indirect tables they
+  // will take.  Those reserved by bfsPrealloc already have one, and are
+  // about to be written
 
-  bioRead(DBNDIR, buf);
+  i32 need = 0;
+  i32 tables = 0;
+  i64 seen[3] = {-1, -1, -1};
+  i32 marked = 0;
+  for (i32 fbn = fbnFirst; fbn <= fbnLast; ++fbn)
+  {
+    i32 dbn = bfsMapWalk(&inode, fbn);
+    if (dbn == 0)
+    {
+      ++need;
+      if (!(inode.flags & INODEEXTENTS))
+        tables += bfsMapMissing(&inode, fbn, seen);
+    }
+    else if ((dbn & EXTENTUNWRITTEN) && !unwritten)
+    {
+      marked += bfsExtentWritten(&inode, fbn);
+    }
+  }
 
-  Dir *dir = (Dir *)buf;
+  // An extent tree takes a leaf when the Inode's Extents overflow, and each
+  // Extent added may split a node on every level, and the root.  A node
+  // splits at most once per EXTENTSPERNODE / 2 Extents added to it
 
-  for (int inum = 0; inum < NUMINODES; ++inum)
-  { // search Directory
-    if (strlen(dir->fname[inum]) == 0)
-    { // free slot
-      strcpy(dir->fname[inum], fname);
-      bioWrite(DBNDIR, dir);
-      bfsRefOFT(inum);
-      return inum;
+  if ((inode.flags & INODEEXTENTS) && need > 0)
+  {
+    i32 height =
+        (inode.extentBlock == 0) ? 0 : bfsMapTable(inode.extentBlock, 0)[1];
+    tables = (height + 3) * (1 + need / (EXTENTSPERNODE / 2));
+  }
+  if (need == 0 && marked == 0)
+  {
+    pthread_mutex_unlock(&g_allocLock);
+    return 0;
+  }
+
+  if (g_numFree < need + tables)
+    FATAL(EDISKFULL); // before anything is mapped
+
+  // Try to continue the file's last run of blocks in place: the search for
+  // free blocks starts just beyond the block mapped to the FBN before the
+  // range.  For an extent Inode, that grows the last extent
+
+  if (fbnFirst > 0)
+  {
+    i32 dbnPrev = bfsMapWalk(&inode, fbnFirst - 1) & ~EXTENTUNWRITTEN;
+    if (dbnPrev != 0 && dbnPrev + 1 < BLOCKSPERDISK)
+      g_allocHint = dbnPrev + 1;
+  }
+
+  // Reserve the data blocks.  Ask for the whole range as one run, and halve
+  // the request whenever the free space is too fragmented to satisfy it
+
+  if (!(inode.flags & INODEEXTENTS))
+    unwritten = 0; // block pointers have no room for the mark
+  i32 mark = unwritten ? EXTENTUNWRITTEN : 0;
+  i32 fbn = fbnFirst;
+  i32 left = need;
+  while (left > 0)
+  {
+    i32 len = left;
+    i32 dbn = bfsFindFreeRun(len);
+    while (dbn == EDISKFULL)
+    {
+      if (len == 1)
+        FATAL(EDISKFULL);
+      len = (len + 1) / 2;
+      dbn = bfsFindFreeRun(len);
+    }
+
+    for (i32 i = 0; i < len; ++fbn)
+    {
+      if (bfsMapWalk(&inode, fbn) != 0)
+        continue; // already mapped
+      bfsMapSet(&inode, fbn, (dbn + i) | mark);
+      ++i;
     }
+    left -= len;
+  }
+
+  bfsWriteInode(inum, &inode);
+  bfsMapFlush();
+
+  // Keep the block map of the open file in step
+
+  i32 ofte = bfsOpenOFTE(inum);
+  for (i32 f = fbnFirst; ofte >= 0 && f <= fbnLast; ++f)
+  {
+    i32 *slot = bfsMapSlot(&g_oft[ofte], f);
+    if (slot != NULL)
+      *slot = bfsMapWritten(&inode, f);
   }
 
-  FATAL(EDIRFULL); // Directory full
-  return 0;        // pacify compiler
+  pthread_mutex_unlock(&g_allocLock);
+  return need;
 }
 
 // ============================================================================
-// Dereference file with Inode number 'inum' in the Open File Table.  If
-// refcount reaches 0, free up that entry in the OFT
+// Take the lowest free inum from the free-inode bitmap, growing the Inode
+// table if none is free.  Every word of g_inodeMap before g_inodeHint is
+// full, so the search rarely looks at more than one word.  Return the inum.
+// On failure, abort
 // ============================================================================
-i32 bfsDerefOFT(i32 inum)
+static i32 bfsAllocInum()
 {
-  i32 ofte = bfsFindOFTE(inum);
-  --g_oft[ofte].refs;
-  if (g_oft[ofte].refs == 0)
+  if (g_numFreeInums == 0 && bfsGrowInodes() != 0)
+    FATAL(EDIRFULL); // Directory full, and cannot grow
+
+  for (i32 w = g_inodeHint;; ++w)
   {
-    g_oft[ofte].inum = 0;
-    g_oft[ofte].curs = 0;
+    if (g_inodeMap[w] != ~0ull)
+    {
+      i32 inum = w * 64 + __builtin_ctzll(~g_inodeMap[w]);
+      g_inodeMap[w] |= 1ull << (inum & 63);
+      --g_numFreeInums;
+      g_inodeHint = w;
+      return inum;
+    }
   }
-  return 0;
 }
 
 // ============================================================================
-// Extend file 'inum' out to FBN 'fbn'
+// Return the # of inums in the Inode table laid out by fsFormat, rounded up
+// to a whole # of Dir blocks.  Chunk k, once the table has grown by k chunks,
+// holds this many inums, times 2^(k-1), starting from the same number: so
+// the table doubles each time it grows
 // ============================================================================
-i32 bfsExtend(i32 inum, i32 fbn)
+static i32 bfsChunkBase()
 {
-  i32 size = bfsGetSize(inum);
-  i32 fbnLast = (size + 1) / BYTESPERBLOCK;
-  for (i32 f = fbnLast; f <= fbn; ++f)
-  {
-    bfsAllocBlock(inum, f);
-  }
-  return 0;
+  return (g_super.numInodes + DIRENTSPERBLOCK - 1) / DIRENTSPERBLOCK *
+         DIRENTSPERBLOCK;
 }
 
 // ============================================================================
-// Use Inode to find the DBN used to store file block 'fbn'.  Return ENODBN
-// if not yet mapped
+// Return the chunk of the Inode table holding inum 'inum': 0 for the table
+// laid out by fsFormat, k >= 1 for the k'th chunk it grew by.  Set 'first' to
+// the chunk's first inum
 // ============================================================================
-i32 bfsFbnToDbn(i32 inum, i32 fbn)
+static i32 bfsChunkOf(i32 inum, i32 *first)
 {
-
-  if (inum < 0)
-    FATAL(EBADINUM);
-  if (inum > MAXINUM)
-    FATAL(EBADINUM);
-  if (fbn < 0)
-    FATAL(EBADFBN);
-  if (fbn > MAXFBN)
-    FATAL(EBADFBN);
-
-  Inode inode;
-
-  bfsReadInode(inum, &inode);
-
-  if (fbn < NUMDIRECT)
-  { // in direct[] array?
-    i32 dbn = inode.direct[fbn];
-    return (dbn == 0) ? ENODBN : dbn;
+  i32 base = bfsChunkBase();
+  if (inum < base)
+  {
+    *first = 0;
+    return 0;
   }
+  i32 k = 32 - __builtin_clz(inum / base);
+  *first = base << (k - 1);
+  return k;
+}
 
-  // fbn is not in direct, so check indirect block.  If it doesn't exist,
-  // then allocate an empty indirect block.  But return ENODBN for the
-  // caller to handle grabing a new data block.
+// ============================================================================
+// Close File Descriptor 'fd': release its slot in the FD table, and its
+// reference to the file's OFTE.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 bfsCloseFd(i32 fd)
+{
+  FDE *f = bfsFde(fd);
+  bfsDerefOFT(g_oft[f->ofte].inum);
+
+  pthread_mutex_lock(&g_oftLock);
+  f->ofte = -1;
+  f->next = g_fdFree;
+  g_fdFree = fd - FDBASE;
+  pthread_mutex_unlock(&g_oftLock);
+  return 0;
+}
 
-  if (inode.indirect == 0)
-  { // no indirect block yet allocated
-    i32 dbn = bfsFindFreeBlock();
-    inode.indirect = dbn;
-    bfsWriteInode(inum, &inode);
-    return ENODBN;
-  }
+// ============================================================================
+// Create file 'fname', which may be a path, such as "a/b/c", through
+// directories made by bfsMakeDir.  Find a free inum; ie, free slot in the
+// Directory.  Leave the size of the file as zero, until the user performs a
+// write, or a seek into the file.  On success, return the file's inum.  If a
+// directory on the path does not exist, return EFNF; if it is a file, return
+// ENOTDIR.  On other failures, abort
+// ============================================================================
+i32 bfsCreateFile(str fname)
+{
 
-  // Check the indirect block
+  if (fname == NULL)
+    FATAL(ENULLPTR);
 
-  i16 buf[NUMINDIRECT] = {0};
-  bioRead(inode.indirect, buf);
+  i32 dir;
+  char name[FNAMESIZE];
+  i32 ret = bfsWalkPath(fname, &dir, name);
+  if (ret == EBIGFNAME)
+    FATAL(EBIGFNAME); // fname too big
+  if (ret != 0)
+    return ret;
+  if (name[0] == 0)
+    return EFNF; // no name after the last '/'
 
-  i32 dbn = buf[fbn - NUMDIRECT];
-  return (dbn == 0) ? ENODBN : dbn;
+  return bfsNewFile(dir, name, 0);
 }
 
 // ============================================================================
-// Convert FileDescriptor (user-visible) to Inum (internal)
+// Return the data held for FBN 'fbn' by the OFT entry 'e', awaiting delayed
+// allocation, or NULL if it holds none
 // ============================================================================
-i32 bfsFdToInum(i32 fd)
+static i8 *bfsDelayFind(OFTE *e, i32 fbn)
 {
-  i32 inum = fd - INUMTOFD;
-  if (inum < 0)
-    FATAL(EBADINUM);
-  return inum;
+  for (i32 i = 0; i < e->numDelay; ++i)
+  {
+    if (e->delayFbn[i] == fbn)
+      return e->delayData + (i64)i * BYTESPERBLOCK;
+  }
+  return NULL;
 }
 
 // ============================================================================
-// Find 'inum' in the Open File Table (OFT).  If not found, create an entry.
-// Return the index within the OFT.  On failure, EOFTFULL
+// Give DBNs to the blocks that open file 'inum' holds for delayed allocation,
+// and write them through the block cache.  The blocks are taken in FBN
+// order, and each run of consecutive FBNs is allocated by one bfsAllocRange,
+// so it lands in one contiguous run of DBNs, just beyond the file's last
+// block where possible.  A block that is all zeros is dropped instead: its
+// FBN stays a hole, which reads as zeros anyway.  The caller holds the
+// file's lock for writing, or has the file to itself.  On success, return
+// the # of blocks written
 // ============================================================================
-i32 bfsFindOFTE(i32 inum)
+i32 bfsDelayFlush(i32 inum)
 {
-  for (int i = 0; i < NUMOFTENTRIES; ++i)
+  i32 ofte = bfsOpenOFTE(inum);
+  if (ofte < 0)
+    return 0;
+  OFTE *e = &g_oft[ofte];
+  i32 n = e->numDelay;
+  if (n == 0)
+    return 0;
+
+  // Sort the blocks that hold data by FBN.  Appends arrive in order, so an
+  // insertion sort rarely moves anything
+
+  i32 order[NUMDELAY];
+  i32 held = n;
+  n = 0;
+  for (i32 i = 0; i < held; ++i)
   {
-    if (g_oft[i].inum == inum)
-      return i;
+    if (bioIsZero(e->delayData + (i64)i * BYTESPERBLOCK))
+      continue;
+    i32 j = n++;
+    for (; j > 0 && e->delayFbn[order[j - 1]] > e->delayFbn[i]; --j)
+      order[j] = order[j - 1];
+    order[j] = i;
   }
 
-  // Not found, so look for an empty OFTE
+  for (i32 first = 0; first < n;)
+  {
+    i32 last = first;
+    while (last + 1 < n &&
+           e->delayFbn[order[last + 1]] == e->delayFbn[order[last]] + 1)
+      ++last;
+    bfsAllocRange(inum, e->delayFbn[order[first]], e->delayFbn[order[last]],
+                  0);
+    first = last + 1;
+  }
+
+  BioVec vec[NUMDELAY];
+  for (i32 i = 0; i < n; ++i)
+  {
+    vec[i].dbn = bfsFbnToDbn(inum, e->delayFbn[order[i]]);
+    vec[i].buf = e->delayData + (i64)order[i] * BYTESPERBLOCK;
+  }
+  if (n > 0)
+    bioWritev(vec, n);
+
+  e->numDelay = 0;
+  return n;
+}
+
+// ============================================================================
+// Write 'len' bytes from 'src' at byte 'off' of FBN 'fbn' of open file
+// 'inum', which has no DBN.  Rather than allocate one now, hold the block in
+// the file's OFT entry until bfsDelayFlush, so a file written a little at a
+// time is allocated a run at a time.  A block new to the file starts out as
+// zeros, and a whole block of zeros is not held at all, since the hole it
+// would fill reads as zeros already.  When NUMDELAY blocks are already held,
+// flush them first.  The caller holds the file's lock for writing.  On
+// success, return 0
+// ============================================================================
+i32 bfsDelayWrite(i32 inum, i32 fbn, i32 off, i32 len, i8 *src)
+{
+  i32 ofte = bfsOpenOFTE(inum);
+  if (ofte < 0)
+    FATAL(EBADINUM); // not open
+  OFTE *e = &g_oft[ofte];
 
-  for (int i = 0; i < NUMOFTENTRIES; ++i)
+  i8 *blk = bfsDelayFind(e, fbn);
+  if (blk == NULL)
   {
-    if (g_oft[i].inum == 0)
+    if (len == BYTESPERBLOCK && bioIsZero(src))
+      return 0; // leave the hole
+    if (e->delayData == NULL)
     {
-      g_oft[i].inum = inum;
-      g_oft[i].curs = 0;
-      g_oft[i].refs = 1;
-      return i;
+      e->delayFbn = malloc(NUMDELAY * sizeof(i32));
+      e->delayData = malloc((i64)NUMDELAY * BYTESPERBLOCK);
+      if (e->delayFbn == NULL || e->delayData == NULL)
+        FATAL(ENOMEM);
     }
+    if (e->numDelay == NUMDELAY)
+      bfsDelayFlush(inum);
+    blk = e->delayData + (i64)e->numDelay * BYTESPERBLOCK;
+    e->delayFbn[e->numDelay++] = fbn;
+    if (len < BYTESPERBLOCK)
+      memset(blk, 0, BYTESPERBLOCK);
   }
-  FATAL(EOFTFULL); // no-return
-  return 0;        // pacify compiler
+  memcpy(blk + off, src, len);
+  return 0;
 }
 
 // ============================================================================
-// Allocate the next free block from the Freelist.  Adjust Freelist
-// accordingly.  On success, return DBN.  FATAL otherwise
+// Delete file 'fname', which may be a path, such as "a/b/c".  Its blocks go
+// back to the free-space bitmap, in one batch, by bfsTruncate.  Then its
+// name is removed - from the Dir's hash, or from its directory's Links and
+// g_dcache - and its Inode cleared, and its inum freed for reuse.  A
+// directory must be empty.  On success, return 0.  If 'fname' does not
+// exist, return EFNF; if it is open, EFILEOPEN; if it is a directory
+// holding files, ENOTEMPTY
 // ============================================================================
-i32 bfsFindFreeBlock()
+i32 bfsDeleteFile(str fname)
 {
-  i8 buf8[BYTESPERBLOCK] = {0};
-  bioRead(DBNSUPER, buf8);
-  Super *super = (Super *)buf8;
 
-  i32 dbn = super->firstFree;
-  if (dbn == 0)
-    FATAL(EDISKFULL);
+  if (fname == NULL)
+    FATAL(ENULLPTR);
 
-  i16 buf16[I16SPERBLOCK] = {0}; // for next free block
-  bioRead(dbn, buf16);
+  i32 dir;
+  char name[FNAMESIZE];
+  if (bfsWalkPath(fname, &dir, name) != 0 || name[0] == 0)
+    return EFNF;
+  i32 inum = bfsDirLookup(dir, name);
+  if (inum == EFNF)
+    return EFNF;
+  if (bfsOpenOFTE(inum) >= 0)
+    return EFILEOPEN;
+
+  if (g_inodes[inum].flags & INODEDIR)
+  {
+    i8 buf[BYTESPERBLOCK];
+    Link *links = (Link *)buf;
+    i32 numBlocks = bfsGetSize(inum) / BYTESPERBLOCK;
+    for (i32 fbn = 0; fbn < numBlocks; ++fbn)
+    {
+      bfsRead(inum, fbn, buf);
+      for (i32 i = 0; i < LINKSPERBLOCK; ++i)
+      {
+        if (links[i].fname[0] != 0)
+          return ENOTEMPTY;
+      }
+    }
+  }
+
+  bfsTruncate(inum, 0);
+
+  if (dir == ROOTINUM)
+  {
+    bfsDirRemove(inum);
+  }
+  else
+  {
+    bfsLinkRemove(dir, inum);
+    Dentry *victim;
+    Dentry *d = bfsDentryFind(dir, name, &victim);
+    if (d != NULL)
+      d->dir = -1; // another file may have the same name: look again
+  }
 
-  super->firstFree = buf16[0]; // new head of Freelist
+  g_dir[inum].fname[0] = 0;
+  i32 b = inum / DIRENTSPERBLOCK;
+  bioWrite(bfsDirDbn(inum), &g_dir[b * DIRENTSPERBLOCK]);
 
-  bioWrite(DBNSUPER, buf8); // update SuperBlock
+  Inode inode;
+  memset(&inode, 0, sizeof(Inode));
+  bfsWriteInode(inum, &inode);
 
-  return dbn;
+  g_inodeMap[inum >> 6] &= ~(1ull << (inum & 63));
+  ++g_numFreeInums;
+  if ((inum >> 6) < g_inodeHint)
+    g_inodeHint = inum >> 6;
+  return 0;
 }
 
 // ============================================================================
-// Initialize the Freelist
+// Return the Dentry in g_dcache for the lookup of 'fname' in directory 'dir'.
+// g_dcache is DCACHEWAYS-way set associative: if none of the set that the
+// lookup hashes to holds it, return NULL, and set 'victim' to the one in the
+// set least recently used
 // ============================================================================
-i32 bfsInitFreeList()
+static Dentry *bfsDentryFind(i32 dir, str fname, Dentry **victim)
 {
-  i16 buf[I16SPERBLOCK] = {0};
-  i32 ret = 0;
+  u32 h = bfsDirHashName(fname) ^ ((u32)dir * 2654435761u);
+  h ^= h >> 16; // fold the high bits into the set number
+  Dentry *set = &g_dcache[(h & (NUMDCACHE / DCACHEWAYS - 1)) * DCACHEWAYS];
 
-  for (int dbn = NUMMETA; dbn < BLOCKSPERDISK - 1; ++dbn)
+  *victim = &set[0];
+  for (i32 i = 0; i < DCACHEWAYS; ++i)
   {
-    buf[0] = dbn + 1;
-    bioWrite(dbn, (i8 *)buf);
+    Dentry *d = &set[i];
+    if (d->dir == dir && strcmp(d->fname, fname) == 0)
+    {
+      d->used = ++g_dcacheClock;
+      return d;
+    }
+    if ((*victim)->dir != -1 && (d->dir == -1 || d->used < (*victim)->used))
+      *victim = d;
   }
-
-  buf[0] = 0;
-  bioWrite(BLOCKSPERDISK - 1, (i8 *)buf); // end of Freelist
-
-  return ret;
+  return NULL;
 }
 
 // ============================================================================
-// Write the initial Dir block, of all zeroes, into DBN 2
+// Dereference file with Inode number 'inum' in the Open File Table.  If
+// refcount reaches 0, write out any blocks held for delayed allocation, and
+// free up that entry in the OFT.  The count drops atomically; only the last
+// reference takes g_oftLock, and frees the entry unless the file has been
+// opened again meanwhile
 // ============================================================================
-i32 bfsInitDir(FILE *fp)
+i32 bfsDerefOFT(i32 inum)
 {
-  if (fp == NULL)
-    FATAL(ENULLPTR);
-  i8 buf[BYTESPERBLOCK] = {0};
-  return bioWrite(DBNDIR, buf);
+  i32 ofte = bfsOpenOFTE(inum);
+  if (ofte < 0)
+    FATAL(EBADINUM); // not open
+  if (__atomic_sub_fetch(&g_oft[ofte].refs, 1, __ATOMIC_ACQ_REL) > 0)
+    return 0;
+
+  pthread_mutex_lock(&g_oftLock);
+  if (g_oft[ofte].refs == 0 && g_inumOfte[inum] == ofte)
+  {
+    bfsDelayFlush(inum); // the last writer has gone
+    bfsMapForget(&g_oft[ofte]);
+    g_oft[ofte].next = g_oftFree;
+    g_oftFree = ofte;
+    g_inumOfte[inum] = -1;
+  }
+  pthread_mutex_unlock(&g_oftLock);
+  return 0;
 }
 
 // ============================================================================
-// Write the initial Inodes block, of all zeroes, into DBN 1
+// Return the DBN of the Dir block holding the entry for inum 'inum'.  Chunks
+// the Inode table grew by hold their Dir blocks just after their Inodes
 // ============================================================================
-i32 bfsInitInodes(FILE *fp)
+i32 bfsDirDbn(i32 inum)
 {
-  if (fp == NULL)
-    FATAL(ENULLPTR);
-  i8 buf[BYTESPERBLOCK] = {0};
-  return bioWrite(DBNINODES, buf);
+  i32 first;
+  i32 k = bfsChunkOf(inum, &first);
+  if (k == 0)
+    return DBNDIR + inum / DIRENTSPERBLOCK;
+  return g_super.dbnChunk[k - 1] + first / INODESPERBLOCK +
+         (inum - first) / DIRENTSPERBLOCK;
 }
 
 // ============================================================================
-// Initialize the Open File Table to all zeroes
+// Return the inum of the file called 'fname', found through the hash index of
+// the resident Dir, or EFNF if there is none.  Of several files with the same
+// name, return the one created first
 // ============================================================================
-i32 bfsInitOFT()
+static i32 bfsDirFind(str fname)
 {
-  for (i32 i = 0; i < NUMOFTENTRIES; ++i)
+  for (u32 h = bfsDirHashName(fname);; ++h)
   {
-    g_oft[i].inum = 0;
-    g_oft[i].curs = 0;
-    g_oft[i].refs = 0;
+    i32 inum = g_dirHash[h & g_dirHashMask];
+    if (inum < 0)
+      return EFNF;
+    if (strcmp(fname, g_dir[inum].fname) == 0)
+      return inum;
   }
-  return 0;
 }
 
 // ============================================================================
-// Write the initial Super block into DBN 0
+// Hash the file name 'fname' (FNV-1a)
 // ============================================================================
-i32 bfsInitSuper(FILE *fp)
+static u32 bfsDirHashName(str fname)
 {
-
-  if (fp == NULL)
-    FATAL(ENULLPTR);
-
-  Super sb;
-  sb.numBlocks = BLOCKSPERDISK; // eg: 100
-  sb.numInodes = NUMINODES;     // eg: 8
-  sb.firstFree = NUMMETA;       // eg: 3
-
-  i8 buf[BYTESPERBLOCK] = {0};
-  memcpy(buf, &sb, sizeof(Super));
-
-  return bioWrite(DBNSUPER, buf);
+  u32 h = 2166136261u;
+  for (; *fname; ++fname)
+    h = (h ^ (u8)*fname) * 16777619u;
+  return h;
 }
 
 // ============================================================================
-// Convert between inum (internal) and FileDescriptor (user-visible)
-// ============================================================================
-i32 bfsInumToFd(i32 inum) { return inum + INUMTOFD; }
-
-// ============================================================================
-// Lookup 'fname' in the Directory.  If found, return its inum.  If not,
-// return EFNF
+// Build the hash index of the resident Dir, and the free-inode bitmap: an
+// inum is free if its Dir entry is.  The inums between the end of the table
+// laid out by fsFormat and its first chunk hold no Inode, so count as used.
+// Files named in a subdirectory are not indexed
 // ============================================================================
-i32 bfsLookupFile(str fname)
+static i32 bfsDirIndex()
 {
+  memset(g_dirHash, -1, (g_dirHashMask + 1) * sizeof(i32));
+  memset(g_inodeMap, 0xff, (NUMINODES + 63) / 64 * sizeof(u64));
+  g_inodeHint = 0;
+  g_numFreeInums = 0;
 
-  if (fname == NULL)
-    FATAL(ENULLPTR);
-
-  i8 buf[BYTESPERBLOCK] = {0};
-
-  bioRead(DBNDIR, buf);
-
-  Dir *dir = (Dir *)buf;
-
-  for (int inum = 0; inum < NUMINODES; ++inum)
+  for (i32 inum = 0; inum < NUMINODES; ++inum)
   {
-    if (strcmp(fname, dir->fname[inum]) == 0)
+    if (inum >= g_super.numInodes && inum < bfsChunkBase())
+      continue; // no Inode
+    if (g_dir[inum].fname[0] == 0)
     {
-      bfsRefOFT(inum);
-      return inum;
+      g_inodeMap[inum >> 6] &= ~(1ull << (inum & 63));
+      ++g_numFreeInums;
+    }
+    else if (strcmp(g_dir[inum].fname, DIRLINKED))
+    {
+      bfsDirInsert(inum);
     }
   }
-
-  return EFNF;
+  return 0;
 }
 
 // ============================================================================
-// Read FBN 'fbn' for the file whose inum is 'inum' into 'buf'
+// Return the inum of the file called 'fname' in directory 'dir', or EFNF if
+// there is none.  The Dir itself ('dir' = ROOTINUM) is resident, and hash
+// indexed.  A subdirectory is a file of Links: the result of each lookup in
+// one, found or not, is remembered in g_dcache, so a repeated lookup does
+// not read the directory again
 // ============================================================================
-i32 bfsRead(i32 inum, i32 fbn, i8 *buf)
+static i32 bfsDirLookup(i32 dir, str fname)
 {
-
-  if (inum < 0)
-    FATAL(EBADINUM);
-  if (inum > MAXINUM)
-    FATAL(EBADINUM);
-  if (fbn < 0)
-    FATAL(EBADFBN);
-  if (fbn > MAXFBN)
-    FATAL(EBADFBN);
-
-  i32 dbn = bfsFbnToDbn(inum, fbn);
-
-  bioRead(dbn, buf);
-  return 0;
+  if (dir == ROOTINUM)
+    return bfsDirFind(fname);
+
+  Dentry *victim;
+  Dentry *d = bfsDentryFind(dir, fname, &victim);
+  if (d != NULL)
+    return d->inum;
+
+  victim->dir = dir;
+  victim->inum = bfsLinkFind(dir, fname);
+  victim->used = ++g_dcacheClock;
+  strcpy(victim->fname, fname);
+  return victim->inum;
 }
 
 // ============================================================================
-// Read the Inodes block.  Extract and return the Inode whose number is 'inum'.
-// On success, return 0.  On failure, abort
+// Add the Dir entry of file 'inum' to the hash index.  Probing is linear; the
+// index has at least twice as many slots as there are Inodes, so never fills
 // ============================================================================
-i32 bfsReadInode(i32 inum, Inode *inode)
+static i32 bfsDirInsert(i32 inum)
 {
-
-  if (inum < 0)
-    FATAL(EBADINUM);
-  if (inum > MAXINUM)
-    FATAL(EBADINUM);
-  if (inode == NULL)
-    FATAL(ENULLPTR);
-
-  i8 buf[BYTESPERBLOCK] = {0};
-
-  bioRead(DBNINODES, buf);
-
-  Inode *inodes = (Inode *)buf;
-
-  memcpy(inode, &inodes[inum], sizeof(Inode));
+  u32 h = bfsDirHashName(g_dir[inum].fname);
+  while (g_dirHash[h & g_dirHashMask] >= 0)
+    ++h;
+  g_dirHash[h & g_dirHashMask] = inum;
   return 0;
 }
 
 // ============================================================================
-// Reference file with Inode number 'inum' in the Open File Table
+// Remove inum 'inum', whose Dir entry still holds its name, from g_dirHash.
+// The entries after it in the probe sequence are inserted again, since a
+// lookup of any of them may have probed past the slot now empty
 // ============================================================================
-i32 bfsRefOFT(i32 inum)
+static i32 bfsDirRemove(i32 inum)
 {
-  i32 ofte = bfsFindOFTE(inum);
-  ++g_oft[ofte].refs;
+  u32 h = bfsDirHashName(g_dir[inum].fname);
+  while (g_dirHash[h & g_dirHashMask] != inum)
+    ++h;
+  g_dirHash[h & g_dirHashMask] = -1;
+
+  for (++h; g_dirHash[h & g_dirHashMask] >= 0; ++h)
+  {
+    i32 other = g_dirHash[h & g_dirHashMask];
+    g_dirHash[h & g_dirHashMask] = -1;
+    bfsDirInsert(other);
+  }
   return 0;
 }
 
 // ============================================================================
-// Set cursor position for the file open on File Descriptor 'fd' to 'newCurs'
+// Add the mapping of the 'len' FBNs from 'fbn' on to the DBNs from 'dbn' on
+// to the 'count' Extents of 'list', sorted by FBN, with room for 'max'.  When
+// 'dbn' follows on from the Extent before 'fbn', that Extent simply grows;
+// when the run leads into the Extent after, that one grows downwards.
+// Otherwise a new Extent is inserted.  A DBN marked EXTENTUNWRITTEN only
+// follows on from another so marked.  On success, return 0.  If 'list' is
+// full, return EBIGNUMB
 // ============================================================================
-i32 bfsSetCursor(i32 inum, i32 newCurs)
+static i32 bfsExtentAdd(Extent *list, i32 *count, i32 max, i32 fbn, i32 dbn,
+                        i32 len)
 {
+  i32 i = bfsExtentFind(list, *count, fbn);
+  if (i >= 0 && fbn < list[i].fbn + list[i].len)
+    FATAL(EBADFBN); // already mapped
+  if (i + 1 < *count && list[i + 1].fbn < fbn + len)
+    FATAL(EBADFBN);
 
-  if (inum < 0)
-    FATAL(EBADINUM);
-  if (inum > MAXINUM)
-    FATAL(EBADINUM);
+  Extent *prev = (i >= 0) ? &list[i] : NULL;
+  Extent *next = (i + 1 < *count) ? &list[i + 1] : NULL;
+  i32 joinPrev = prev && prev->fbn + prev->len == fbn &&
+                 prev->dbn + prev->len == dbn;
+  i32 joinNext = next && next->fbn == fbn + len && next->dbn == dbn + len;
 
-  i32 ofte = bfsFindOFTE(inum);
-  g_oft[ofte].curs = newCurs;
-  return 0;
+  if (joinPrev)
+  {
+    prev->len += len;
+    if (joinNext)
+    { // 'fbn' closed the gap between two Extents
+      prev->len += next->len;
+      memmove(next, next + 1, (*count - i - 2) * sizeof(Extent));
+      memset(&list[--*count], 0, sizeof(Extent));
+    }
+    return 0;
+  }
+  if (joinNext)
+  {
+    next->fbn -= len;
+    next->dbn -= len;
+    next->len += len;
+    return 0;
+  }
+
+  Extent e = {fbn, dbn, len};
+  return bfsExtentPut(list, count, max, &e);
 }
 
 // ============================================================================
-// Return the cursor position for the file open on File Descriptor 'fd'
+// Binary search the 'count' Extents of 'list' for the last one that starts
+// at or before FBN 'fbn'.  Return its index, or -1 if there is none
 // ============================================================================
-i32 bfsTell(i32 fd)
+static i32 bfsExtentFind(Extent *list, i32 count, i32 fbn)
 {
-  i32 inum = bfsFdToInum(fd);
-  i32 ofte = bfsFindOFTE(inum);
-  return g_oft[ofte].curs;
+  i32 lo = 0;
+  i32 hi = count - 1;
+  i32 found = -1;
+  while (lo <= hi)
+  {
+    i32 mid = lo + (hi - lo) / 2;
+    if (list[mid].fbn <= fbn)
+    {
+      found = mid;
+      lo = mid + 1;
+    }
+    else
+    {
+      hi = mid - 1;
+    }
+  }
+  return found;
 }
 
 // ============================================================================
-// Return the size of the file whose Inode number is 'inum'
+// Add Extent 'e' to the subtree of the extent tree rooted at node 'node'.
+// Each node is a block, held in g_maps: word 0 is its # of entries, word 1
+// its height (0 => leaf), and the entries follow, sorted by FBN.  A leaf
+// holds Extents.  In a higher node, each entry's 'dbn' is a child node that
+// holds the FBNs from the entry's 'fbn' up to the next entry's.  A full node
+// splits in two: return 1, and set 'split' to the entry for the new right
+// half, for the caller to add to the parent.  Otherwise return 0
 // ============================================================================
-i32 bfsGetSize(i32 inum)
+static i32 bfsExtentInsert(i32 node, Extent *e, Extent *split)
 {
+  i32 *table = bfsMapTable(node, 0);
+  i32 height = table[1];
+  Extent add = *e; // entry to add to this node
 
-  if (inum < 0)
-    FATAL(EBADINUM);
-  if (inum > MAXINUM)
-    FATAL(EBADINUM);
-
-  Inode inode;
-  bfsReadInode(inum, &inode);
+  if (height > 0)
+  {
+    Extent *list = (Extent *)(table + 2);
+    i32 i = bfsExtentFind(list, table[0], e->fbn);
+    if (!bfsExtentInsert(list[(i < 0) ? 0 : i].dbn, e, &add))
+      return 0; // child absorbed it
+  }
 
-  return inode.size;
+  // 'table' may have been evicted from g_maps meanwhile, so look it up again
+
+  table = bfsMapTable(node, 0);
+  i32 count = table[0];
+  Extent *list = (Extent *)(table + 2);
+  i32 full = (height == 0)
+                 ? bfsExtentAdd(list, &count, EXTENTSPERNODE, add.fbn, add.dbn,
+                                add.len)
+                 : bfsExtentPut(list, &count, EXTENTSPERNODE, &add);
+  table[0] = count;
+  bfsMapDirty(node);
+  if (full == 0)
+    return 0;
+
+  // Node full: move its upper half to a new node, then add to either half
+
+  i32 numLower = count / 2;
+  i32 numUpper = count - numLower;
+  Extent upper[EXTENTSPERNODE];
+  memcpy(upper, list + numLower, numUpper * sizeof(Extent));
+  memset(list + numLower, 0, numUpper * sizeof(Extent));
+  table[0] = numLower;
+
+  i32 dbnUpper = bfsFindFreeBlock();
+  table = bfsMapTable(dbnUpper, 1);
+  table[0] = numUpper;
+  table[1] = height;
+  memcpy(table + 2, upper, numUpper * sizeof(Extent));
+
+  i32 half = (add.fbn >= upper[0].fbn) ? dbnUpper : node;
+  table = bfsMapTable(half, 0);
+  count = table[0];
+  list = (Extent *)(table + 2);
+  if (height == 0)
+    bfsExtentAdd(list, &count, EXTENTSPERNODE, add.fbn, add.dbn, add.len);
+  else
+    bfsExtentPut(list, &count, EXTENTSPERNODE, &add);
+  table[0] = count;
+  bfsMapDirty(half);
+
+  split->fbn = bfsMapTable(dbnUpper, 0)[2]; // first FBN of the upper half
+  split->dbn = dbnUpper;
+  split->len = 0;
+  return 1;
 }
 
 // ============================================================================
-// Set size of file 'inum' to 'size
+// Insert Extent 'e' into the 'count' Extents of 'list', sorted by FBN, with
+// room for 'max'.  On success, return 0.  If 'list' is full, return EBIGNUMB
 // ============================================================================
-i32 bfsSetSize(i32 inum, i32 size)
+static i32 bfsExtentPut(Extent *list, i32 *count, i32 max, Extent *e)
 {
+  if (*count >= max)
+    return EBIGNUMB;
 
-  if (inum < 0)
-    FATAL(EBADINUM);
-  if (inum > MAXINUM)
-    FATAL(EBADINUM);
-
-  Inode inode;
-  bfsReadInode(inum, &inode);
-
-  inode.size = size;
-  bfsWriteInode(inum, &inode);
+  i32 i = bfsExtentFind(list, *count, e->fbn) + 1; // where 'e' goes
+  memmove(&list[i + 1], &list[i], (*count - i) * sizeof(Extent));
+  list[i] = *e;
+  ++*count;
   return 0;
 }
 
 // ============================================================================
-// Update the Inodes block on disk with the info in 'inode'
+// Map the 'len' FBNs from 'fbn' on of extent Inode 'inode', not yet mapped,
+// to the DBNs from 'dbn' on.  The Extents live in the Inode until it runs out
+// of room.  Then they move to a leaf block, the root of an extent tree, which
+// grows a level whenever its root splits
 // ============================================================================
-i32 bfsWriteInode(i32 inum, Inode *inode)
+static i32 bfsExtentSet(Inode *inode, i32 fbn, i32 dbn, i32 len)
 {
-
+  if (inode->extentBlock == 0)
+  {
+    i32 count = 0;
+    while (count < NUMEXTENTS && inode->extent[count].len > 0)
+      ++count;
+    if (bfsExtentAdd(inode->extent, &count, NUMEXTENTS, fbn, dbn, len) == 0)
+      return 0;
+
+    // Inode full: its Extents become the first leaf of an extent tree
+
+    i32 dbnLeaf = bfsFindFreeBlock();
+    i32 *table = bfsMapTable(dbnLeaf, 1);
+    table[0] = count;
+    table[1] = 0;
+    memcpy(table + 2, inode->extent, count * sizeof(Extent));
+    memset(inode->extent, 0, sizeof(inode->extent));
+    inode->extentBlock = dbnLeaf;
+  }
+
+  Extent e = {fbn, dbn, len};
+  Extent split;
+  if (bfsExtentInsert(inode->extentBlock, &e, &split))
+  { // the root split: grow the tree by a level
+    i32 height = bfsMapTable(inode->extentBlock, 0)[1];
+    i32 dbnRoot = bfsFindFreeBlock();
+    i32 *table = bfsMapTable(dbnRoot, 1);
+    Extent *list = (Extent *)(table + 2);
+    table[0] = 2;
+    table[1] = height + 1;
+    list[0].fbn = 0;
+    list[0].dbn = inode->extentBlock;
+    list[0].len = 0;
+    list[1] = split;
+    inode->extentBlock = dbnRoot;
+  }
+  return 0;
+}
+
+// ============================================================================
+// Add the Extents of the subtree of the extent tree rooted at node 'node' to
+// 'keep', in FBN order, and its nodes to 'gone'.  The nodes are dropped from
+// g_maps
+// ============================================================================
+static i32 bfsExtentGather(i32 node, RunList *keep, RunList *gone)
+{
+  i32 *table = bfsMapTable(node, 0);
+  i32 count = table[0];
+  for (i32 i = 0; i < count; ++i)
+  {
+    table = bfsMapTable(node, 0); // a child may have evicted it
+    Extent e = ((Extent *)(table + 2))[i];
+    if (table[1] == 0)
+      bfsRunAdd(keep, e.fbn, e.dbn, e.len);
+    else
+      bfsExtentGather(e.dbn, keep, gone);
+  }
+  bfsMapDrop(node);
+  return bfsRunAdd(gone, 0, node, 1);
+}
+
+// ============================================================================
+// Unmap every FBN from 'keep' on of extent Inode 'inode', adding the blocks
+// to 'gone'.  The Extents are gathered, and any extent tree is freed whole.
+// The blocks are freed, so the tree may reuse them, and then the Extents
+// kept are mapped again, from the Inode up.  So deleting a file, however
+// large, only reads its tree
+// ============================================================================
+static i32 bfsExtentTrunc(Inode *inode, i32 keep, RunList *gone)
+{
+  RunList kept = {NULL, 0, 0};
+  if (inode->extentBlock != 0)
+  {
+    bfsExtentGather(inode->extentBlock, &kept, gone);
+  }
+  else
+  {
+    for (i32 i = 0; i < NUMEXTENTS && inode->extent[i].len > 0; ++i)
+    {
+      Extent *e = &inode->extent[i];
+      bfsRunAdd(&kept, e->fbn, e->dbn, e->len);
+    }
+  }
+  memset(inode->extent, 0, sizeof(inode->extent));
+  inode->extentBlock = 0;
+
+  // Cut the Extents at 'keep'
+
+  i32 num = 0;
+  for (i32 i = 0; i < kept.num; ++i)
+  {
+    Extent e = kept.run[i];
+    i32 dbn = e.dbn & ~EXTENTUNWRITTEN;
+    if (e.fbn >= keep)
+    {
+      bfsRunAdd(gone, 0, dbn, e.len);
+      continue;
+    }
+    if (e.fbn + e.len > keep)
+    {
+      i32 cut = keep - e.fbn;
+      bfsRunAdd(gone, 0, dbn + cut, e.len - cut);
+      e.len = cut;
+    }
+    kept.run[num++] = e;
+  }
+  bfsFreeRuns(gone);
+
+  for (i32 i = 0; i < num; ++i)
+    bfsExtentSet(inode, kept.run[i].fbn, kept.run[i].dbn, kept.run[i].len);
+  free(kept.run);
+  return 0;
+}
+
+// ============================================================================
+// Return the DBN that FBN 'fbn' of extent Inode 'inode' maps to, or 0 if
+// unmapped, by binary search of its Extents, down the extent tree if it has
+// one.  The DBN keeps any EXTENTUNWRITTEN mark
+// ============================================================================
+static i32 bfsExtentWalk(Inode *inode, i32 fbn)
+{
+  Extent *list = inode->extent;
+  i32 count = 0;
+  while (count < NUMEXTENTS && list[count].len > 0)
+    ++count;
+
+  for (i32 node = inode->extentBlock; node != 0;)
+  {
+    i32 *table = bfsMapTable(node, 0);
+    list = (Extent *)(table + 2);
+    count = table[0];
+    if (table[1] == 0)
+      break; // leaf
+    i32 i = bfsExtentFind(list, count, fbn);
+    node = list[(i < 0) ? 0 : i].dbn;
+  }
+
+  i32 i = bfsExtentFind(list, count, fbn);
+  if (i < 0 || fbn >= list[i].fbn + list[i].len)
+    return 0;
+  return list[i].dbn + (fbn - list[i].fbn);
+}
+
+// ============================================================================
+// Mark FBN 'fbn' of extent Inode 'inode', reserved by bfsPrealloc, as
+// written.  It is cut out of its EXTENTUNWRITTEN Extent - off the front, for
+// a file written in order - and mapped again without the mark, where it
+// joins the written Extent before it, if any.  Return 1
+// ============================================================================
+static i32 bfsExtentWritten(Inode *inode, i32 fbn)
+{
+  // Find the list of Extents holding 'fbn': the Inode's, or a leaf's
+
+  Extent *list = inode->extent;
+  i32 count = 0;
+  while (count < NUMEXTENTS && list[count].len > 0)
+    ++count;
+
+  i32 *table = NULL;
+  i32 node = inode->extentBlock;
+  while (node != 0)
+  {
+    table = bfsMapTable(node, 0);
+    list = (Extent *)(table + 2);
+    count = table[0];
+    if (table[1] == 0)
+      break; // leaf
+    i32 i = bfsExtentFind(list, count, fbn);
+    node = list[(i < 0) ? 0 : i].dbn;
+  }
+
+  i32 i = bfsExtentFind(list, count, fbn);
+  Extent e = list[i];
+  i32 dbn = (e.dbn & ~EXTENTUNWRITTEN) + (fbn - e.fbn);
+  Extent upper = {fbn + 1, e.dbn + (fbn + 1 - e.fbn), e.fbn + e.len - fbn - 1};
+
+  if (fbn == e.fbn)
+  { // off the front
+    ++list[i].fbn;
+    ++list[i].dbn;
+    upper.len = 0;
+  }
+  list[i].len = (fbn == e.fbn) ? e.len - 1 : fbn - e.fbn;
+  if (list[i].len == 0)
+  {
+    memmove(&list[i], &list[i + 1], (count - i - 1) * sizeof(Extent));
+    memset(&list[--count], 0, sizeof(Extent));
+  }
+  if (table != NULL)
+  {
+    table[0] = count;
+    bfsMapDirty(node);
+  }
+
+  if (upper.len > 0)
+    bfsExtentSet(inode, upper.fbn, upper.dbn, upper.len);
+  bfsExtentSet(inode, fbn, dbn, 1);
+  return 1;
+}
+
+// ============================================================================
+// Open a new File Descriptor on file 'inum', with its own cursor, at 0, and
+// its own readahead stream.  It takes the first free slot of the FD table,
+// and references the file's OFTE, which every FD on the file shares.  On
+// success, return the File Descriptor.  On failure, abort
+// ============================================================================
+i32 bfsOpenFd(i32 inum)
+{
+  if (inum < 0)
+    FATAL(EBADINUM);
+  if (inum > MAXINUM)
+    FATAL(EBADINUM);
+  pthread_mutex_lock(&g_oftLock);
+  i32 slot = g_fdFree;
+  if (slot >= 0)
+    g_fdFree = g_fdt[slot].next;
+  else if (g_fdHigh < NUMFDS)
+    slot = g_fdHigh++;
+  else
+    FATAL(EOFTFULL); // FD table full
+
+  FDE *f = &g_fdt[slot];
+  f->ofte = bfsFindOFTE(inum);
+  __atomic_add_fetch(&g_oft[f->ofte].refs, 1, __ATOMIC_ACQ_REL);
+  f->curs = 0;
+  f->raNext = 0;
+  f->raWindow = 0;
+  f->raEnd = 0;
+  f->raBusy = 0;
+  pthread_mutex_unlock(&g_oftLock);
+  return slot + FDBASE;
+}
+
+// ============================================================================
+// Return the OFT index of file 'inum' if it is open, else -1.  Unlike
+// bfsFindOFTE, never claims a new entry
+// ============================================================================
+static i32 bfsOpenOFTE(i32 inum) { return g_inumOfte[inum]; }
+
+// ============================================================================
+// Fill the block map of OFT entry 'ofte' from its file's direct[] array and
+// single indirect table.  Unmapped FBNs hold 0.  FBNs beyond NUMMAPFBN are
+// found through the tables held in g_maps instead.  The caller holds
+// g_allocLock
+// ============================================================================
+static i32 bfsLoadMap(i32 ofte)
+{
+  OFTE *e = &g_oft[ofte];
+  if (e->map == NULL)
+  {
+    e->map = malloc(NUMMAPFBN * sizeof(i32));
+    if (e->map == NULL)
+      FATAL(ENOMEM);
+  }
+
+  Inode *inode = &g_inodes[e->inum];
+
+  if (inode->flags & INODEEXTENTS)
+  {
+    for (i32 fbn = 0; fbn < NUMMAPFBN; ++fbn)
+      e->map[fbn] = bfsMapWritten(inode, fbn);
+    __atomic_store_n(&e->mapValid, 1, __ATOMIC_RELEASE);
+    return 0;
+  }
+
+  for (i32 fbn = 0; fbn < NUMDIRECT; ++fbn)
+    e->map[fbn] = inode->direct[fbn];
+
+  if (inode->indirect == 0)
+    memset(e->map + NUMDIRECT, 0, NUMINDIRECT * sizeof(i32));
+  else
+    memcpy(e->map + NUMDIRECT, bfsMapTable(inode->indirect, 0),
+           NUMINDIRECT * sizeof(i32));
+
+  __atomic_store_n(&e->mapValid, 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+// ============================================================================
+// Make the directory 'path', such as "a/b", whose parent must already exist.
+// On success, return its inum.  If the parent does not exist, return EFNF;
+// if the parent is a file, ENOTDIR; if 'path' already exists, EFEXISTS; if
+// the disk is revision 1, whose Inodes have no flags to mark a directory,
+// ENYI.  On other failures, abort
+// ============================================================================
+i32 bfsMakeDir(str path)
+{
+
+  if (path == NULL)
+    FATAL(ENULLPTR);
+  if (g_geo.revision == 1)
+    return ENYI; // revision 1 Inodes have no flags, so cannot mark one
+
+  i32 dir;
+  char name[FNAMESIZE];
+  i32 ret = bfsWalkPath(path, &dir, name);
+  if (ret == EBIGFNAME)
+    FATAL(EBIGFNAME);
+  if (ret != 0)
+    return ret;
+  if (name[0] == 0)
+    return EFEXISTS; // the Dir itself
+
+  if (bfsDirLookup(dir, name) != EFNF)
+    return EFEXISTS;
+  return bfsNewFile(dir, name, INODEDIR);
+}
+
+// ============================================================================
+// Create the file called 'fname' in directory 'dir', with Inode flags
+// 'flags'.  It takes the lowest free inum, and writes its Dir entry's block
+// through the block cache.  In a subdirectory, that entry only marks
+// the inum as used, and a Link in the directory names the file.  Return the
+// new inum.  On failure, abort
+// ============================================================================
+static i32 bfsNewFile(i32 dir, str fname, i32 flags)
+{
+  i32 inum = bfsAllocInum();
+  strcpy(g_dir[inum].fname, (dir == ROOTINUM) ? fname : DIRLINKED);
+  i32 b = inum / DIRENTSPERBLOCK;
+  bioWrite(bfsDirDbn(inum), &g_dir[b * DIRENTSPERBLOCK]);
+
+  if (dir == ROOTINUM)
+  {
+    bfsDirInsert(inum);
+  }
+  else
+  {
+    bfsLinkAdd(dir, fname, inum);
+
+    // A cached miss is now wrong.  A cached hit stays right: of two files
+    // with one name, lookups find the one created first
+
+    Dentry *victim;
+    Dentry *d = bfsDentryFind(dir, fname, &victim);
+    if (d != NULL && d->inum == EFNF)
+      d->inum = inum;
+  }
+
+  bfsInitMapping(inum);
+  if (flags != 0)
+  {
+    Inode inode;
+    bfsReadInode(inum, &inode);
+    inode.flags |= flags;
+    bfsWriteInode(inum, &inode);
+  }
+  return inum;
+}
+
+// ============================================================================
+// Note that the table of block 'dbn', held in g_maps, has changed
+// ============================================================================
+static i32 bfsMapDirty(i32 dbn)
+{
+  for (i32 i = 0; i < NUMMAPCACHE; ++i)
+  {
+    if (g_maps[i].dbn == dbn)
+    {
+      g_maps[i].dirty = 1;
+      return 0;
+    }
+  }
+  FATAL(EBADDBN); // not held
+  return 0;       // pacify compiler
+}
+
+// ============================================================================
+// Forget the table held in g_maps for block 'dbn', if any, without writing
+// it back: the block has been freed
+// ============================================================================
+static i32 bfsMapDrop(i32 dbn)
+{
+  for (i32 i = 0; i < NUMMAPCACHE; ++i)
+  {
+    if (g_maps[i].dbn == dbn)
+    {
+      g_maps[i].dbn = 0;
+      g_maps[i].dirty = 0;
+    }
+  }
+  return 0;
+}
+
+// ============================================================================
+// Write the table held in 'm' to its block, in the DBN width of the disk's
+// revision.  It passes through the block cache, so reaches BFSDISK with the
+// next bioSync
+// ============================================================================
+static i32 bfsMapStore(MapBlock *m)
+{
+  if (g_geo.dbnSize == sizeof(i32))
+  {
+    bioWrite(m->dbn, m->table);
+  }
+  else
+  {
+    i16 buf16[I16SPERBLOCK]; // revision 1: 16-bit DBNs
+    for (i32 i = 0; i < NUMINDIRECT; ++i)
+      buf16[i] = m->table[i];
+    bioWrite(m->dbn, buf16);
+  }
+  m->dirty = 0;
+  return 0;
+}
+
+// ============================================================================
+// Write every changed table in g_maps to its block
+// ============================================================================
+static i32 bfsMapFlush()
+{
+  for (i32 i = 0; i < NUMMAPCACHE; ++i)
+  {
+    if (g_maps[i].dbn != 0 && g_maps[i].dirty)
+      bfsMapStore(&g_maps[i]);
+  }
+  return 0;
+}
+
+// ============================================================================
+// Find where FBN 'fbn', at or beyond NUMDIRECT, hangs in the tree of indirect
+// tables of 'inode'.  Return the Inode field that roots the tree - indirect,
+// dindirect or tindirect - set 'depth' to the # of tables on the path, and
+// 'idx' to the index into each table, from the root down
+// ============================================================================
+static i32 *bfsMapPath(Inode *inode, i32 fbn, i32 *depth, i32 *idx)
+{
+  i64 n = NUMINDIRECT;
+  i64 f = fbn - NUMDIRECT;
+
+  if (f < n)
+  {
+    *depth = 1;
+    idx[0] = f;
+    return &inode->indirect;
+  }
+  f -= n;
+  if (f < n * n)
+  {
+    *depth = 2;
+    idx[0] = f / n;
+    idx[1] = f % n;
+    return &inode->dindirect;
+  }
+  f -= n * n;
+  *depth = 3;
+  idx[0] = f / (n * n);
+  idx[1] = (f / n) % n;
+  idx[2] = f % n;
+  return &inode->tindirect;
+}
+
+// ============================================================================
+// Forget the block map cached in OFT entry 'e', freeing its segments beyond
+// NUMMAPFBN, because its file's blocks have changed or the entry is being
+// released.  No other thread may be using the map: the caller holds the
+// file's lock for writing, or the file is not open
+// ============================================================================
+static i32 bfsMapForget(OFTE *e)
+{
+  __atomic_store_n(&e->mapValid, 0, __ATOMIC_RELEASE);
+  if (e->ext == NULL)
+    return 0;
+  for (i32 k = 0; k < e->numExt; ++k)
+    free(e->ext[k]);
+  free(e->ext);
+  e->ext = NULL;
+  e->numExt = 0;
+  return 0;
+}
+
+// ============================================================================
+// Return where the block map of OFT entry 'e' holds the DBN of FBN 'fbn',
+// which is NUMMAPFBN or beyond, or NULL if the map does not reach it.  That
+// part of the map is a segment per NUMINDIRECT FBNs, covering as many FBNs as
+// the disk has blocks, and each segment is decoded from the Inode the first
+// time it is needed, under g_allocLock.  After that it is read with no lock
+// at all, so readers of a large file never meet in the allocator
+// ============================================================================
+static i32 *bfsMapSegment(OFTE *e, i32 fbn)
+{
+  i32 k = (fbn - NUMMAPFBN) / NUMINDIRECT;
+  i32 **ext = __atomic_load_n(&e->ext, __ATOMIC_ACQUIRE);
+  i32 *seg = NULL;
+  if (ext != NULL)
+  {
+    if (k >= e->numExt)
+      return NULL;
+    seg = __atomic_load_n(&ext[k], __ATOMIC_ACQUIRE);
+  }
+
+  if (seg == NULL)
+  { // readers of the file may race to decode it: the first one does
+    pthread_mutex_lock(&g_allocLock);
+    if (e->ext == NULL)
+    {
+      i32 numExt = (BLOCKSPERDISK + NUMINDIRECT - 1) / NUMINDIRECT;
+      ext = calloc(numExt, sizeof(i32 *));
+      if (ext == NULL)
+        FATAL(ENOMEM);
+      e->numExt = numExt;
+      __atomic_store_n(&e->ext, ext, __ATOMIC_RELEASE);
+    }
+    if (k < e->numExt && e->ext[k] == NULL)
+    {
+      seg = malloc(NUMINDIRECT * sizeof(i32));
+      if (seg == NULL)
+        FATAL(ENOMEM);
+      Inode *inode = &g_inodes[e->inum];
+      i64 base = NUMMAPFBN + (i64)k * NUMINDIRECT;
+      for (i32 i = 0; i < NUMINDIRECT; ++i)
+        seg[i] = (base + i < MAXFBN) ? bfsMapWritten(inode, base + i) : 0;
+      __atomic_store_n(&e->ext[k], seg, __ATOMIC_RELEASE);
+    }
+    seg = (k < e->numExt) ? e->ext[k] : NULL;
+    pthread_mutex_unlock(&g_allocLock);
+    if (seg == NULL)
+      return NULL;
+  }
+  return seg + (fbn - NUMMAPFBN) % NUMINDIRECT;
+}
+
+// ============================================================================
+// Map FBN 'fbn' of 'inode' to DBN 'dbn'.  Indirect tables missing on the way
+// are allocated, and start out empty.  Changed tables stay in g_maps until
+// bfsMapFlush; the caller writes 'inode' back
+// ============================================================================
+static i32 bfsMapSet(Inode *inode, i32 fbn, i32 dbn)
+{
+  if (inode->flags & INODEEXTENTS)
+    return bfsExtentSet(inode, fbn, dbn, 1);
+
+  if (fbn < NUMDIRECT)
+  {
+    inode->direct[fbn] = dbn;
+    return 0;
+  }
+
+  i32 depth;
+  i32 idx[3];
+  i32 *root = bfsMapPath(inode, fbn, &depth, idx);
+  if (*root == 0)
+  {
+    *root = bfsFindFreeBlock();
+    bfsMapTable(*root, 1);
+  }
+
+  i32 dbnTable = *root;
+  for (i32 level = 0; level < depth - 1; ++level)
+  {
+    i32 *table = bfsMapTable(dbnTable, 0);
+    i32 child = table[idx[level]];
+    if (child == 0)
+    { // table for the next level is missing
+      child = bfsFindFreeBlock();
+      table[idx[level]] = child;
+      bfsMapDirty(dbnTable);
+      bfsMapTable(child, 1);
+    }
+    dbnTable = child;
+  }
+
+  bfsMapTable(dbnTable, 0)[idx[depth - 1]] = dbn;
+  bfsMapDirty(dbnTable);
+  return 0;
+}
+
+// ============================================================================
+// Return where the block map of OFT entry 'e' holds the DBN of FBN 'fbn', so
+// that a change to the file's blocks can be made there too, or NULL if that
+// part of the map is not loaded.  The caller holds g_allocLock
+// ============================================================================
+static i32 *bfsMapSlot(OFTE *e, i32 fbn)
+{
+  if (fbn < NUMMAPFBN)
+    return e->mapValid ? &e->map[fbn] : NULL;
+  i32 k = (fbn - NUMMAPFBN) / NUMINDIRECT;
+  if (k >= e->numExt || e->ext[k] == NULL)
+    return NULL;
+  return e->ext[k] + (fbn - NUMMAPFBN) % NUMINDIRECT;
+}
+
+// ============================================================================
+// Return the indirect table held in block 'dbn', decoded into NUMINDIRECT
+// DBNs.  Tables stay in g_maps, so walking the same tables again reads
+// nothing; the least recently used one makes way for a table not yet held.
+// 'fresh' = 1 => 'dbn' has just been allocated, so start the table empty.
+// The pointer is good until the next call
+// ============================================================================
+static i32 *bfsMapTable(i32 dbn, i32 fresh)
+{
+  MapBlock *victim = &g_maps[0];
+  for (i32 i = 0; i < NUMMAPCACHE; ++i)
+  {
+    MapBlock *m = &g_maps[i];
+    if (m->dbn == dbn)
+    {
+      m->used = ++g_mapClock;
+      if (fresh)
+      {
+        memset(m->table, 0, NUMINDIRECT * sizeof(i32));
+        m->dirty = 1;
+      }
+      return m->table;
+    }
+    if (victim->dbn != 0 && (m->dbn == 0 || m->used < victim->used))
+      victim = m;
+  }
+
+  if (victim->dbn != 0 && victim->dirty)
+    bfsMapStore(victim);
+
+  victim->dbn = dbn;
+  victim->dirty = fresh;
+  victim->used = ++g_mapClock;
+
+  if (fresh)
+  {
+    memset(victim->table, 0, NUMINDIRECT * sizeof(i32));
+  }
+  else if (g_geo.dbnSize == sizeof(i32))
+  {
+    bioRead(dbn, victim->table);
+  }
+  else
+  {
+    i16 buf16[I16SPERBLOCK]; // revision 1: 16-bit DBNs
+    bioRead(dbn, buf16);
+    for (i32 i = 0; i < NUMINDIRECT; ++i)
+      victim->table[i] = buf16[i];
+  }
+  return victim->table;
+}
+
+// ============================================================================
+// Unmap every FBN from 'keep' on in the tree of indirect tables rooted at
+// '*slot', 'depth' tables deep, whose first entry maps FBN 'base'.  The data
+// blocks unmapped are added to 'gone', as is any table left mapping
+// nothing, which is dropped from g_maps, and '*slot' cleared
+// ============================================================================
+static i32 bfsMapTrunc(i32 *slot, i32 depth, i64 base, i32 keep,
+                       RunList *gone)
+{
+  if (*slot == 0)
+    return 0;
+  i64 span = 1; // FBNs mapped by each entry
+  for (i32 d = 1; d < depth; ++d)
+    span *= NUMINDIRECT;
+  if (base + span * NUMINDIRECT <= keep)
+    return 0; // every FBN it maps is kept
+
+  i32 live = 0;
+  for (i32 i = 0; i < NUMINDIRECT; ++i)
+  {
+    i32 *table = bfsMapTable(*slot, 0);
+    i32 child = table[i];
+    if (child == 0)
+      continue;
+    i64 first = base + i * span;
+    if (depth == 1 && first >= keep)
+      bfsRunAdd(gone, 0, child, 1);
+    else if (depth > 1)
+      bfsMapTrunc(&child, depth - 1, first, keep, gone);
+
+    if (depth == 1 && first >= keep)
+      child = 0;
+    table = bfsMapTable(*slot, 0); // the subtree may have evicted it
+    if (table[i] != child)
+    {
+      table[i] = child;
+      bfsMapDirty(*slot);
+    }
+    live |= (child != 0);
+  }
+
+  if (!live)
+  {
+    bfsMapDrop(*slot);
+    bfsRunAdd(gone, 0, *slot, 1);
+    *slot = 0;
+  }
+  return 0;
+}
+
+// ============================================================================
+// Return the DBN that FBN 'fbn' of 'inode' maps to, or 0 if unmapped.  The
+// DBN keeps any EXTENTUNWRITTEN mark
+// ============================================================================
+static i32 bfsMapWalk(Inode *inode, i32 fbn)
+{
+  if (inode->flags & INODEEXTENTS)
+    return bfsExtentWalk(inode, fbn);
+
+  if (fbn < NUMDIRECT)
+    return inode->direct[fbn];
+
+  i32 depth;
+  i32 idx[3];
+  i32 dbn = *bfsMapPath(inode, fbn, &depth, idx);
+  for (i32 level = 0; level < depth && dbn != 0; ++level)
+    dbn = bfsMapTable(dbn, 0)[idx[level]];
+  return dbn;
+}
+
+// ============================================================================
+// Return the # of indirect tables that mapping FBN 'fbn' of block-pointer
+// Inode 'inode' would allocate.  'seen' holds, per level, the last missing
+// table already counted, so a caller walking up through the FBNs of a range
+// counts each table once.  It starts out as {-1, -1, -1}
+// ============================================================================
+static i32 bfsMapMissing(Inode *inode, i32 fbn, i64 *seen)
+{
+  if (fbn < NUMDIRECT)
+    return 0;
+
+  i32 depth;
+  i32 idx[3];
+  i32 dbn = *bfsMapPath(inode, fbn, &depth, idx);
+  i32 missing = 0;
+  i64 key = depth; // which table: the root it hangs from, and the path to it
+  for (i32 level = 0; level < depth; ++level)
+  {
+    if (dbn == 0 && seen[level] != key)
+    {
+      seen[level] = key;
+      ++missing;
+    }
+    if (dbn != 0)
+      dbn = bfsMapTable(dbn, 0)[idx[level]];
+    key = key * NUMINDIRECT + idx[level];
+  }
+  return missing;
+}
+
+// ============================================================================
+// Return the DBN that FBN 'fbn' of 'inode' maps to, or 0 if unmapped, or
+// only reserved, with EXTENTUNWRITTEN, and so still reading as zeros
+// ============================================================================
+static i32 bfsMapWritten(Inode *inode, i32 fbn)
+{
+  i32 dbn = bfsMapWalk(inode, fbn);
+  return (dbn & EXTENTUNWRITTEN) ? 0 : dbn;
+}
+
+// ============================================================================
+// Use Inode to find the DBN used to store file block 'fbn'.  Return ENODBN
+// if not yet mapped, or only reserved by bfsPrealloc and not yet written.
+// For an open file, the answer comes from the block map cached in its OFT
+// entry, decoding it on first use, so readers of a file, however large,
+// take no lock once its map is decoded
+// ============================================================================
+i32 bfsFbnToDbn(i32 inum, i32 fbn)
+{
+
+  if (inum < 0)
+    FATAL(EBADINUM);
+  if (inum > MAXINUM)
+    FATAL(EBADINUM);
+  if (fbn < 0)
+    FATAL(EBADFBN);
+  if (fbn >= MAXFBN)
+    FATAL(EBADFBN);
+
+  i32 ofte = bfsOpenOFTE(inum);
+  if (ofte >= 0 && fbn < NUMMAPFBN)
+  {
+    if (!__atomic_load_n(&g_oft[ofte].mapValid, __ATOMIC_ACQUIRE))
+    { // readers of the file may race to load it: the first one does
+      pthread_mutex_lock(&g_allocLock);
+      if (!g_oft[ofte].mapValid)
+        bfsLoadMap(ofte);
+      pthread_mutex_unlock(&g_allocLock);
+    }
+    i32 dbn = g_oft[ofte].map[fbn];
+    return (dbn == 0) ? ENODBN : dbn;
+  }
+
+  i32 *slot = (ofte < 0) ? NULL : bfsMapSegment(&g_oft[ofte], fbn);
+  if (slot != NULL)
+    return (*slot == 0) ? ENODBN : *slot;
+
+  // Walk the Inode, and any indirect tables, down to the block.  The tables
+  // are held in g_maps, so a walk reads each from the block cache only once
+
+  pthread_mutex_lock(&g_allocLock);
+  i32 dbn = bfsMapWritten(&g_inodes[inum], fbn);
+  pthread_mutex_unlock(&g_allocLock);
+  return (dbn == 0) ? ENODBN : dbn;
+}
+
+// ============================================================================
+// Convert FileDescriptor (user-visible) to Inum (internal)
+// ============================================================================
+i32 bfsFdToInum(i32 fd) { return g_oft[bfsFde(fd)->ofte].inum; }
+
+// ============================================================================
+// Return the slot in the FD table of File Descriptor 'fd'.  If 'fd' is not
+// open, abort
+// ============================================================================
+static FDE *bfsFde(i32 fd)
+{
+  i32 slot = fd - FDBASE;
+  if (slot < 0 || slot >= __atomic_load_n(&g_fdHigh, __ATOMIC_ACQUIRE) ||
+      g_fdt[slot].ofte < 0)
+    FATAL(EBADFD);
+  return &g_fdt[slot];
+}
+
+// ============================================================================
+// Find 'inum' in the Open File Table (OFT).  If not found, claim a free entry,
+// with no references yet.  Return the index within the OFT.  On failure,
+// abort with EOFTFULL.  The caller holds g_oftLock
+// ============================================================================
+i32 bfsFindOFTE(i32 inum)
+{
+  if (g_inumOfte[inum] >= 0)
+    return g_inumOfte[inum];
+
+  i32 ofte = g_oftFree;
+  if (ofte >= 0)
+    g_oftFree = g_oft[ofte].next;
+  else if (g_oftHigh < NUMOFTENTRIES)
+  {
+    ofte = g_oftHigh++;
+    pthread_rwlock_init(&g_oft[ofte].lock, NULL);
+  }
+  else
+    FATAL(EOFTFULL);
+
+  g_oft[ofte].inum = inum;
+  g_oft[ofte].refs = 0;
+  bfsMapForget(&g_oft[ofte]);
+  g_inumOfte[inum] = ofte;
+  return ofte;
+}
+
+// ============================================================================
+// Mark 'len' blocks, starting at 'dbn', as in use ('used' = 1) or free
+// ('used' = 0) in the resident bitmap, and note which bitmap blocks changed
+// ============================================================================
+static i32 bfsMarkBlocks(i32 dbn, i32 len, i32 used)
+{
+  for (i32 d = dbn; d < dbn + len; ++d)
+  {
+    u64 *w = &g_bitmap[d >> 6];
+    u64 bit = 1ull << (d & 63);
+    if (used && !(*w & bit))
+    {
+      *w |= bit;
+      --g_numFree;
+    }
+    else if (!used && (*w & bit))
+    {
+      *w &= ~bit;
+      ++g_numFree;
+    }
+    g_bitmapDirty[d / BITSPERBLOCK] = 1;
+    if (g_freeLink != NULL)
+      g_freeLink[d] = -1; // the block's contents are no longer its link
+  }
+  return 0;
+}
+
+// ============================================================================
+// Search the bitmap, a word at a time, for 'len' contiguous free blocks at or
+// beyond DBN 'from'.  Return the first DBN of the run, or EDISKFULL if there
+// is none.  Runs of used or free blocks are skipped with a single count of
+// trailing bits, so a full or empty word costs one step
+// ============================================================================
+static i32 bfsSearchRun(i32 from, i32 len)
+{
+  i32 run = 0; // # of free blocks immediately before 'dbn'
+  i32 dbn = from;
+
+  while (dbn < BLOCKSPERDISK)
+  {
+    i32 off = dbn & 63;
+    u64 w = g_bitmap[dbn >> 6] >> off; // status of 'dbn' onwards
+    i32 avail = 64 - off;              // bits of this word left to scan
+    i32 n;
+
+    if (w & 1)
+    { // in use: skip over the run of 1 bits
+      n = (~w == 0) ? avail : __builtin_ctzll(~w);
+      if (n > avail)
+        n = avail;
+      run = 0;
+    }
+    else
+    { // free: count the run of 0 bits
+      n = (w == 0) ? avail : __builtin_ctzll(w);
+      if (run + n >= len)
+        return dbn - run;
+      run += n;
+    }
+    dbn += n;
+  }
+  return EDISKFULL;
+}
+
+// ============================================================================
+// Allocate the next free block from the free-space bitmap.  The search starts
+// just after the last block allocated, so blocks handed out in succession
+// tend to be contiguous.  On success, return DBN.  FATAL otherwise
+// ============================================================================
+i32 bfsFindFreeBlock()
+{
+  i32 dbn = bfsSearchRun(g_allocHint, 1);
+  if (dbn == EDISKFULL)
+    dbn = bfsSearchRun(0, 1);
+  if (dbn == EDISKFULL)
+    FATAL(EDISKFULL);
+
+  bfsMarkBlocks(dbn, 1, 1);
+  g_allocHint = dbn + 1;
+  return dbn;
+}
+
+// ============================================================================
+// Allocate 'len' contiguous free blocks.  On success, return the first DBN of
+// the run.  If there is no free run that long, return EDISKFULL - non fatal -
+// so the caller can fall back to smaller runs
+// ============================================================================
+i32 bfsFindFreeRun(i32 len)
+{
+  if (len <= 0)
+    FATAL(ENEGNUMB);
+
+  i32 dbn = bfsSearchRun(g_allocHint, len);
+  if (dbn == EDISKFULL)
+    dbn = bfsSearchRun(0, len);
+  if (dbn == EDISKFULL)
+    return EDISKFULL;
+
+  bfsMarkBlocks(dbn, len, 1);
+  g_allocHint = dbn + len;
+  return dbn;
+}
+
+// ============================================================================
+// Return block 'dbn' to the free-space bitmap
+// ============================================================================
+i32 bfsFreeBlock(i32 dbn)
+{
+  if (dbn < DBNDIR + NUMDIRBLOCKS)
+    FATAL(EBADDBN); // holds the SuperBlock, Inodes or Dir
+  if (dbn >= BLOCKSPERDISK)
+    FATAL(EBADDBN);
+  if (dbn >= g_super.dbnBitmap && dbn < g_super.dbnBitmap + g_super.numBitmap)
+    FATAL(EBADDBN); // holds the bitmap itself
+
+  pthread_mutex_lock(&g_allocLock);
+  bfsMarkBlocks(dbn, 1, 0);
+  if (dbn < g_allocHint)
+    g_allocHint = dbn;
+  pthread_mutex_unlock(&g_allocLock);
+  return 0;
+}
+
+// ============================================================================
+// Compare runs by DBN, for qsort
+// ============================================================================
+static int bfsCmpRun(const void *a, const void *b)
+{
+  i32 da = ((const Extent *)a)->dbn;
+  i32 db = ((const Extent *)b)->dbn;
+  return (da > db) - (da < db);
+}
+
+// ============================================================================
+// Mark every run of blocks in 'gone' free in the bitmap, in one pass, and
+// empty 'gone'.  Only the bitmap blocks they fall in are dirtied, so
+// freeing a whole file costs a few bitmap writes at the next sync.  The
+// runs are sorted by DBN and adjacent ones joined - a file mapped by block
+// pointers frees its blocks one at a time - and each joined run is
+// discarded from the block cache, so its dirty blocks are never written,
+// and punched out of BFSDISK if long.  The caller holds g_allocLock, so no
+// run is reallocated before it is discarded
+// ============================================================================
+static i32 bfsFreeRuns(RunList *gone)
+{
+  if (gone->num > 1)
+    qsort(gone->run, gone->num, sizeof(Extent), bfsCmpRun);
+
+  for (i32 i = 0; i < gone->num;)
+  {
+    i32 dbn = gone->run[i].dbn;
+    i32 len = gone->run[i].len;
+    for (++i; i < gone->num && gone->run[i].dbn == dbn + len; ++i)
+      len += gone->run[i].len;
+    if (dbn < DBNDIR + NUMDIRBLOCKS || dbn + len > BLOCKSPERDISK)
+      FATAL(EBADDBN);
+    bfsMarkBlocks(dbn, len, 0);
+    bioDiscard(dbn, len);
+    if (dbn < g_allocHint)
+      g_allocHint = dbn;
+  }
+  gone->num = 0;
+  return 0;
+}
+
+// ============================================================================
+// Initialize the free-space bitmap: the metadata blocks are in use, the rest
+// of the disk is free.  Bits beyond the end of the disk are marked in use so
+// they are never allocated
+// ============================================================================
+i32 bfsInitFreeList()
+{
+  memset(g_bitmap, 0, (i64)NUMBITMAP * BYTESPERBLOCK);
+  g_numFree = BLOCKSPERDISK;
+  bfsMarkBlocks(0, NUMMETA, 1);
+  for (i32 d = BLOCKSPERDISK; d < NUMBITMAP * BITSPERBLOCK; ++d)
+    g_bitmap[d >> 6] |= 1ull << (d & 63);
+  g_allocHint = NUMMETA;
+
+  BioVec vec[NUMBITMAP];
+  for (i32 b = 0; b < NUMBITMAP; ++b)
+  {
+    vec[b].dbn = DBNBITMAP + b;
+    vec[b].buf = (i8 *)g_bitmap + b * BYTESPERBLOCK;
+    g_bitmapDirty[b] = 0;
+  }
+
+  return bioWritev(vec, NUMBITMAP);
+}
+
+// ============================================================================
+// Load Inodes block 'b' from disk into the resident Inodes, widening the
+// Inodes of a revision 1 disk
+// ============================================================================
+static i32 bfsReadInodeBlock(i32 b)
+{
+  Inode *inodes = &g_inodes[b * INODESPERBLOCK];
+  if (g_geo.inodeSize == sizeof(Inode))
+    return bioRead(bfsInodeDbn(b * INODESPERBLOCK), inodes);
+
+  i8 buf[BYTESPERBLOCK];
+  bioRead(bfsInodeDbn(b * INODESPERBLOCK), buf);
+  Inode1 *old = (Inode1 *)buf;
+  memset(inodes, 0, INODESPERBLOCK * sizeof(Inode));
+  for (i32 i = 0; i < INODESPERBLOCK; ++i)
+  {
+    inodes[i].size = old[i].size;
+    for (i32 d = 0; d < NUMDIRECT; ++d)
+      inodes[i].direct[d] = old[i].direct[d];
+    inodes[i].indirect = old[i].indirect;
+  }
+  return 0;
+}
+
+// ============================================================================
+// Write the resident Inodes of Inodes block 'b' back to disk, narrowed to
+// the Inode1 form for a revision 1 disk
+// ============================================================================
+static i32 bfsWriteInodeBlock(i32 b)
+{
+  Inode *inodes = &g_inodes[b * INODESPERBLOCK];
+  if (g_geo.inodeSize == sizeof(Inode))
+    return bioWrite(bfsInodeDbn(b * INODESPERBLOCK), inodes);
+
+  i8 buf[BYTESPERBLOCK];
+  memset(buf, 0, BYTESPERBLOCK);
+  Inode1 *old = (Inode1 *)buf;
+  for (i32 i = 0; i < INODESPERBLOCK; ++i)
+  {
+    old[i].size = inodes[i].size;
+    for (i32 d = 0; d < NUMDIRECT; ++d)
+      old[i].direct[d] = inodes[i].direct[d];
+    old[i].indirect = inodes[i].indirect;
+  }
+  return bioWrite(bfsInodeDbn(b * INODESPERBLOCK), buf);
+}
+
+// ============================================================================
+// Write the resident SuperBlock into DBN 0, in the form of the disk's revision
+// ============================================================================
+static i32 bfsWriteSuper()
+{
+  i8 buf[BYTESPERBLOCK];
+  memset(buf, 0, BYTESPERBLOCK);
+
+  if (g_super.revision >= 2)
+  {
+    memcpy(buf, &g_super, sizeof(Super));
+  }
+  else
+  {
+    Super1 *old = (Super1 *)buf;
+    old->numBlocks = g_super.numBlocks;
+    old->numInodes = g_super.numInodes;
+    old->firstFree = g_super.firstFree;
+    old->dbnBitmap = g_super.dbnBitmap;
+    old->numBitmap = g_super.numBitmap;
+    old->bytesPerBlock = g_super.bytesPerBlock;
+    old->dbnInodes = g_super.dbnInodes;
+    old->dbnDir = g_super.dbnDir;
+  }
+  return bioWrite(DBNSUPER, buf);
+}
+
+// ============================================================================
+// Grow the Inode table by one chunk, as many inums as it already holds, with
+// its Dir entries: one run of zeroed blocks, taken from the free space and
+// recorded in the SuperBlock.  The resident tables grow to match.  On
+// success, return 0.  If the disk has no room, or the SuperBlock no slot for
+// another chunk, return EDIRFULL
+// ============================================================================
+static i32 bfsGrowInodes()
+{
+  i32 k = g_super.numChunks + 1;
+  if (g_geo.revision == 1 || k > NUMCHUNKS)
+    return EDIRFULL; // revision 1 SuperBlocks have no chunks
+  i64 first = (i64)bfsChunkBase() << (k - 1);
+  if (first > (1 << 28))
+    return EDIRFULL; // the Dir hash index would outgrow an i32
+
+  i32 numBlocks = first / INODESPERBLOCK + first / DIRENTSPERBLOCK;
+  i32 dbn = bfsFindFreeRun(numBlocks);
+  if (dbn == EDISKFULL)
+    return EDIRFULL;
+
+  i8 zeros[BYTESPERBLOCK];
+  memset(zeros, 0, BYTESPERBLOCK);
+  BioVec vec[BIOVECBATCH];
+  i32 numVec = 0;
+  for (i32 b = 0; b < numBlocks; ++b)
+  {
+    vec[numVec].dbn = dbn + b;
+    vec[numVec].buf = zeros;
+    if (++numVec == BIOVECBATCH)
+    {
+      bioWritev(vec, numVec);
+      numVec = 0;
+    }
+  }
+  if (numVec > 0)
+    bioWritev(vec, numVec);
+
+  g_super.dbnChunk[k - 1] = dbn;
+  g_super.numChunks = k;
+  bfsWriteSuper();
+
+  // Grow the resident Inodes, Dir, bitmap and hash index over the new inums
+
+  i32 oldInodeBlocks = INODETABLEBLOCKS;
+  i32 oldDirBlocks = DIRTABLEBLOCKS;
+  i32 oldNumInodes = NUMINODES;
+  g_geo.numInodes = 2 * first;
+
+  i32 numSlots = g_dirHashMask + 1;
+  while (numSlots < 2 * NUMINODES)
+    numSlots *= 2;
+  g_dirHashMask = numSlots - 1;
+
+  g_inodes = realloc(g_inodes,
+                     (i64)INODETABLEBLOCKS * INODESPERBLOCK * sizeof(Inode));
+  g_inodeDirty = realloc(g_inodeDirty, INODETABLEBLOCKS);
+  g_dir = realloc(g_dir, (i64)DIRTABLEBLOCKS * BYTESPERBLOCK);
+  g_dirHash = realloc(g_dirHash, numSlots * sizeof(i32));
+  g_inodeMap = realloc(g_inodeMap, (NUMINODES + 63) / 64 * sizeof(u64));
+  g_inumOfte = realloc(g_inumOfte, NUMINODES * sizeof(i32));
+  if (!g_inodes || !g_inodeDirty || !g_dir || !g_dirHash || !g_inodeMap ||
+      !g_inumOfte)
+    FATAL(ENOMEM);
+
+  i32 newInodeBlocks = INODETABLEBLOCKS - oldInodeBlocks;
+  i32 newDirBlocks = DIRTABLEBLOCKS - oldDirBlocks;
+  memset(&g_inodes[oldInodeBlocks * INODESPERBLOCK], 0,
+         (i64)newInodeBlocks * INODESPERBLOCK * sizeof(Inode));
+  memset(g_inodeDirty + oldInodeBlocks, 0, newInodeBlocks);
+  memset(&g_dir[oldDirBlocks * DIRENTSPERBLOCK], 0,
+         (i64)newDirBlocks * BYTESPERBLOCK);
+  memset(&g_inumOfte[oldNumInodes], -1,
+         (i64)(NUMINODES - oldNumInodes) * sizeof(i32));
+  return bfsDirIndex();
+}
+
+// ============================================================================
+// Write the initial Dir blocks, of all zeroes, from DBN 'DBNDIR' onwards.
+// Also clear the resident Dir, and its index
+// ============================================================================
+i32 bfsInitDir()
+{
+  memset(g_dir, 0, (i64)DIRTABLEBLOCKS * BYTESPERBLOCK);
+
+  for (i32 b = 0; b < DIRTABLEBLOCKS; ++b)
+    bioWrite(DBNDIR + b, &g_dir[b * DIRENTSPERBLOCK]);
+  return bfsDirIndex();
+}
+
+// ============================================================================
+// Set the geometry of the disk that fsFormat is about to create: its block
+// size, its size in blocks, and its number of Inodes.  'extents' = 1 => the
+// files created on it map their blocks with Extents.  Lay out the Inodes,
+// Dir and bitmap blocks, one after the other, just beyond the SuperBlock.  On
+// success, return 0.  On failure, abort
+// ============================================================================
+i32 bfsInitGeometry(i32 bytesPerBlock, i32 numBlocks, i32 numInodes,
+                    i32 extents)
+{
+  if (bytesPerBlock < MINBYTESPERBLOCK || bytesPerBlock > MAXBYTESPERBLOCK)
+    FATAL(EBADGEOM);
+  if ((bytesPerBlock & (bytesPerBlock - 1)) != 0)
+    FATAL(EBADGEOM); // not a power of 2
+  if (numBlocks <= 0)
+    FATAL(EBADGEOM);
+  if (numInodes <= 0)
+    FATAL(EBADGEOM);
+
+  i32 inodesPerBlock = bytesPerBlock / sizeof(Inode);
+  i32 direntsPerBlock = bytesPerBlock / sizeof(DirEnt);
+  i32 bitsPerBlock = bytesPerBlock * 8;
+
+  Super sb;
+  memset(&sb, 0, sizeof(Super));
+  sb.revision = BFSREVISION;
+  sb.flags = extents ? SUPEREXTENTS : 0;
+  sb.numBlocks = numBlocks;
+  sb.numInodes = numInodes;
+  sb.firstFree = 0; // free space is tracked in the bitmap
+  sb.bytesPerBlock = bytesPerBlock;
+  sb.dbnInodes = 1;
+  sb.dbnDir = sb.dbnInodes + (numInodes + inodesPerBlock - 1) / inodesPerBlock;
+  sb.dbnBitmap = sb.dbnDir + (numInodes + direntsPerBlock - 1) / direntsPerBlock;
+  sb.numBitmap = (numBlocks + bitsPerBlock - 1) / bitsPerBlock;
+  if ((i64)sb.dbnBitmap + sb.numBitmap >= numBlocks)
+    FATAL(EBADGEOM); // no room left for file data
+
+  g_super = sb;
+  return bfsSetGeometry(&g_super);
+}
+
+// ============================================================================
+// Write the initial Inodes blocks, of all zeroes, from DBN 'DBNINODES'
+// onwards.  Also clear the resident Inodes
+// ============================================================================
+i32 bfsInitInodes()
+{
+  memset(g_inodes, 0, (i64)INODETABLEBLOCKS * INODESPERBLOCK * sizeof(Inode));
+  memset(g_inodeDirty, 0, INODETABLEBLOCKS);
+
+  for (i32 b = 0; b < INODETABLEBLOCKS; ++b)
+    bfsWriteInodeBlock(b);
+  return 0;
+}
+
+// ============================================================================
+// Prepare the Inode of file 'inum', just created, to map blocks.  An Inode
+// never used is all zeroes, so maps with block pointers.  On a disk formatted
+// for extents, it becomes an extent Inode instead
+// ============================================================================
+static i32 bfsInitMapping(i32 inum)
+{
+  Inode inode;
+  bfsReadInode(inum, &inode);
+
+  Inode unused;
+  memset(&unused, 0, sizeof(Inode));
+  if (memcmp(&inode, &unused, sizeof(Inode)) != 0)
+    return 0; // already holds a file
+
+  if (g_super.flags & SUPEREXTENTS)
+  {
+    inode.flags |= INODEEXTENTS;
+    bfsWriteInode(inum, &inode);
+  }
+  return 0;
+}
+
+// ============================================================================
+// Initialize the Open File Table and the FD table, with every entry free
+// ============================================================================
+i32 bfsInitOFT()
+{
+  for (i32 i = 0; i < g_oftHigh; ++i)
+    pthread_rwlock_destroy(&g_oft[i].lock);
+
+  for (i32 i = 0; i < NUMOFTENTRIES; ++i)
+  {
+    g_oft[i].inum = 0;
+    g_oft[i].refs = 0;
+    free(g_oft[i].map);
+    g_oft[i].map = NULL;
+    bfsMapForget(&g_oft[i]);
+    free(g_oft[i].delayFbn);
+    free(g_oft[i].delayData);
+    g_oft[i].delayFbn = NULL;
+    g_oft[i].delayData = NULL;
+    g_oft[i].numDelay = 0;
+  }
+  g_oftFree = -1;
+  g_oftHigh = 0;
+
+  g_fdFree = -1;
+  g_fdHigh = 0;
+
+  if (g_inumOfte != NULL)
+    memset(g_inumOfte, -1, NUMINODES * sizeof(i32));
+  return 0;
+}
+
+// ============================================================================
+// Write the initial Super block, describing the geometry set by
+// bfsInitGeometry, into DBN 0
+// ============================================================================
+i32 bfsInitSuper() { return bfsWriteSuper(); }
+
+// ============================================================================
+// Return the DBN of the Inodes block holding Inode 'inum', or 0 if there is no
+// such Inode.  The blocks of the table laid out by fsFormat are consecutive;
+// a chunk the table grew by holds its Inodes blocks at its start
+// ============================================================================
+i32 bfsInodeDbn(i32 inum)
+{
+  if (inum < g_super.numInodes)
+    return DBNINODES + inum / INODESPERBLOCK;
+
+  i32 first;
+  i32 k = bfsChunkOf(inum, &first);
+  if (k == 0)
+    return 0; // beyond the table laid out by fsFormat, before chunk 1
+  return g_super.dbnChunk[k - 1] + (inum - first) / INODESPERBLOCK;
+}
+
+// ============================================================================
+// Take the file-system lock: shared ('exclusive' = 0) for operations on the
+// data of open files, or exclusive ('exclusive' = 1) for the rest
+// ============================================================================
+i32 bfsLock(i32 exclusive)
+{
+  if (exclusive)
+    pthread_rwlock_wrlock(&g_fsLock);
+  else
+    pthread_rwlock_rdlock(&g_fsLock);
+  return 0;
+}
+
+// ============================================================================
+// Take the lock of the file open on File Descriptor 'fd': shared ('write' = 0)
+// to read it, or exclusive ('write' = 1) to write it.  The caller holds the
+// file-system lock
+// ============================================================================
+i32 bfsLockFile(i32 fd, i32 write)
+{
+  OFTE *e = &g_oft[bfsFde(fd)->ofte];
+  if (write)
+    pthread_rwlock_wrlock(&e->lock);
+  else
+    pthread_rwlock_rdlock(&e->lock);
+  return 0;
+}
+
+// ============================================================================
+// Lookup 'fname', which may be a path, such as "a/b/c".  If found, return its
+// inum.  If not, return EFNF.  If it names a directory, return EISDIR
+// ============================================================================
+i32 bfsLookupFile(str fname)
+{
+
+  if (fname == NULL)
+    FATAL(ENULLPTR);
+
+  i32 dir;
+  char name[FNAMESIZE];
+  if (bfsWalkPath(fname, &dir, name) != 0 || name[0] == 0)
+    return EFNF;
+
+  i32 inum = bfsDirLookup(dir, name);
+  if (inum == EFNF)
+    return EFNF;
+  if (g_inodes[inum].flags & INODEDIR)
+    return EISDIR;
+  return inum;
+}
+
+// ============================================================================
+// Return the inum of the file called 'fname' in the subdirectory 'dir', by
+// reading its Links, or EFNF if there is none
+// ============================================================================
+static i32 bfsLinkFind(i32 dir, str fname)
+{
+  i8 buf[BYTESPERBLOCK];
+  Link *links = (Link *)buf;
+
+  i32 numBlocks = bfsGetSize(dir) / BYTESPERBLOCK;
+  for (i32 fbn = 0; fbn < numBlocks; ++fbn)
+  {
+    bfsRead(dir, fbn, buf);
+    for (i32 i = 0; i < LINKSPERBLOCK; ++i)
+    {
+      if (strcmp(links[i].fname, fname) == 0)
+        return links[i].inum;
+    }
+  }
+  return EFNF;
+}
+
+// ============================================================================
+// Add a Link naming file 'inum' as 'fname' to the subdirectory 'dir'.  Use the
+// first free Link, or else grow the directory by a block
+// ============================================================================
+static i32 bfsLinkAdd(i32 dir, str fname, i32 inum)
+{
+  i8 buf[BYTESPERBLOCK];
+  Link *links = (Link *)buf;
+
+  i32 numBlocks = bfsGetSize(dir) / BYTESPERBLOCK;
+  for (i32 fbn = 0; fbn < numBlocks; ++fbn)
+  {
+    bfsRead(dir, fbn, buf);
+    for (i32 i = 0; i < LINKSPERBLOCK; ++i)
+    {
+      if (links[i].fname[0] == 0)
+      { // free Link
+        links[i].inum = inum;
+        strcpy(links[i].fname, fname);
+        return bioWrite(bfsFbnToDbn(dir, fbn), buf);
+      }
+    }
+  }
+
+  i32 dbn = bfsAllocBlock(dir, numBlocks);
+  memset(buf, 0, BYTESPERBLOCK);
+  links[0].inum = inum;
+  strcpy(links[0].fname, fname);
+  bioWrite(dbn, buf);
+  return bfsSetSize(dir, (i64)(numBlocks + 1) * BYTESPERBLOCK);
+}
+
+// ============================================================================
+// Clear the Link to inum 'inum' in directory 'dir'.  Its block is written
+// through the block cache.  The directory keeps its size: the slot is reused
+// by bfsLinkAdd
+// ============================================================================
+static i32 bfsLinkRemove(i32 dir, i32 inum)
+{
+  i8 buf[BYTESPERBLOCK];
+  Link *links = (Link *)buf;
+
+  i32 numBlocks = bfsGetSize(dir) / BYTESPERBLOCK;
+  for (i32 fbn = 0; fbn < numBlocks; ++fbn)
+  {
+    bfsRead(dir, fbn, buf);
+    for (i32 i = 0; i < LINKSPERBLOCK; ++i)
+    {
+      if (links[i].fname[0] != 0 && links[i].inum == inum)
+      {
+        memset(&links[i], 0, sizeof(Link));
+        return bioWrite(bfsFbnToDbn(dir, fbn), buf);
+      }
+    }
+  }
+  return EFNF;
+}
+
+// ============================================================================
+// Build the resident free-space bitmap for a disk formatted with a linked
+// Freelist: every block starts in use, then each block on the Freelist is
+// freed.  The disk keeps its Freelist, which bfsSyncFreeList writes back, so
+// mounting never changes the format of a disk
+// ============================================================================
+static i32 bfsLoadFreeList()
+{
+  memset(g_bitmap, 0xff, (i64)NUMBITMAP * BYTESPERBLOCK);
+  g_freeLink = malloc(BLOCKSPERDISK * sizeof(i32));
+  if (g_freeLink == NULL)
+    FATAL(ENOMEM);
+  memset(g_freeLink, -1, BLOCKSPERDISK * sizeof(i32));
+
+  i16 buf16[I16SPERBLOCK];
+  i32 numFree = 0;
+  for (i32 dbn = g_super.firstFree; dbn != 0; dbn = buf16[0])
+  {
+    if (dbn < DBNDIR + NUMDIRBLOCKS || dbn >= BLOCKSPERDISK || numFree >= BLOCKSPERDISK)
+      FATAL(EBADDBN); // corrupt Freelist
+    g_bitmap[dbn >> 6] &= ~(1ull << (dbn & 63));
+    ++numFree;
+    bioRead(dbn, buf16);
+    g_freeLink[dbn] = buf16[0];
+  }
+  g_numFree = numFree;
+  return 0;
+}
+
+// ============================================================================
+// Write the resident bitmap back to a disk that keeps a linked Freelist, as
+// a Freelist of its free blocks in DBN order.  Only the blocks whose link
+// changes are written, and the SuperBlock only if the head of the list moves
+// ============================================================================
+static i32 bfsSyncFreeList()
+{
+  i16 buf16[I16SPERBLOCK];
+  memset(buf16, 0, BYTESPERBLOCK);
+
+  i32 prev = 0; // last free block linked.  0 => none yet: the SuperBlock
+  for (i32 dbn = DBNDIR + NUMDIRBLOCKS; dbn <= BLOCKSPERDISK; ++dbn)
+  {
+    if (dbn < BLOCKSPERDISK && (g_bitmap[dbn >> 6] >> (dbn & 63) & 1))
+      continue; // in use
+    i32 next = (dbn < BLOCKSPERDISK) ? dbn : 0; // 0 ends the Freelist
+    if (prev == 0 && g_super.firstFree != next)
+    {
+      g_super.firstFree = next;
+      bfsWriteSuper();
+    }
+    else if (prev != 0 && g_freeLink[prev] != next)
+    {
+      buf16[0] = next;
+      bioWrite(prev, buf16);
+      g_freeLink[prev] = next;
+    }
+    prev = next;
+  }
+  return 0;
+}
+
+// ============================================================================
+// Mount the BFS disk: open BFSDISK, read the SuperBlock, and derive the
+// geometry of the disk from it.  Then load the free-space bitmap and the
+// Inodes blocks into memory
+// ============================================================================
+i32 bfsMount()
+{
+  // The SuperBlock sits in the first 512 bytes, whatever the block size, so
+  // read it as a block of the original geometry, then reopen BFSDISK with
+  // the block cache sized for the real one
+
+  g_geo.bytesPerBlock = MINBYTESPERBLOCK;
+  g_geo.numBlocks = 1;
+  bioOpen();
+
+  i8 sbuf[MINBYTESPERBLOCK];
+  bioRead(DBNSUPER, sbuf);
+  bioClose();
+
+  Super1 *old = (Super1 *)sbuf;
+  if (old->numBlocks != 0)
+  { // revision 1
+    memset(&g_super, 0, sizeof(Super));
+    g_super.revision = 1;
+    g_super.numBlocks = old->numBlocks;
+    g_super.numInodes = old->numInodes;
+    g_super.firstFree = old->firstFree;
+    g_super.dbnBitmap = old->dbnBitmap;
+    g_super.numBitmap = old->numBitmap;
+    g_super.bytesPerBlock = old->bytesPerBlock;
+    g_super.dbnInodes = old->dbnInodes;
+    g_super.dbnDir = old->dbnDir;
+  }
+  else
+  {
+    memcpy(&g_super, sbuf, sizeof(Super));
+  }
+
+  bfsSetGeometry(&g_super);
+  bioOpen();
+
+  // Invalidate the block maps cached in the OFT, and drop any blocks held
+  // for delayed allocation, which bfsUnmount would have written: their size
+  // depends on the geometry.  Files stay open, on the same File Descriptors
+
+  for (i32 i = 0; i < NUMOFTENTRIES; ++i)
+  {
+    free(g_oft[i].map);
+    g_oft[i].map = NULL;
+    bfsMapForget(&g_oft[i]);
+    free(g_oft[i].delayFbn);
+    free(g_oft[i].delayData);
+    g_oft[i].delayFbn = NULL;
+    g_oft[i].delayData = NULL;
+    g_oft[i].numDelay = 0;
+  }
+
+  if (g_super.dbnBitmap == 0)
+  {
+    bfsLoadFreeList();
+  }
+  else
+  {
+    for (i32 b = 0; b < NUMBITMAP; ++b)
+    {
+      bioRead(DBNBITMAP + b, (i8 *)g_bitmap + (i64)b * BYTESPERBLOCK);
+      g_bitmapDirty[b] = 0;
+    }
+
+    g_numFree = NUMBITMAP * BITSPERBLOCK; // bits beyond the disk are set
+    for (i32 w = 0; w < NUMBITMAP * BITSPERBLOCK / 64; ++w)
+      g_numFree -= __builtin_popcountll(g_bitmap[w]);
+  }
+  g_allocHint = DBNDIR + NUMDIRBLOCKS;
+
+  for (i32 b = 0; b < INODETABLEBLOCKS; ++b)
+  {
+    if (bfsInodeDbn(b * INODESPERBLOCK) != 0)
+      bfsReadInodeBlock(b);
+    g_inodeDirty[b] = 0;
+  }
+
+  // Hold the Dir in memory too, hash-indexed by name
+
+  for (i32 b = 0; b < DIRTABLEBLOCKS; ++b)
+    bioRead(bfsDirDbn(b * DIRENTSPERBLOCK), &g_dir[b * DIRENTSPERBLOCK]);
+  for (i32 inum = 0; inum < NUMINODES; ++inum)
+    g_dir[inum].fname[FNAMESIZE - 1] = 0;
+  return bfsDirIndex();
+}
+
+// ============================================================================
+// Reserve blocks for every FBN from 'fbnFirst' to 'fbnLast' (inclusive) of
+// file 'inum' that has none, as contiguous as free space allows, with one
+// update of the Inode.  An extent Inode maps them EXTENTUNWRITTEN, so they
+// read as zeros, and nothing is written to them, until the file writes
+// them.  Block pointers have no room for the mark, so there the new blocks
+// are zeroed, in batches that bioWritev coalesces.  The file must hold no
+// blocks for delayed allocation.  On success, return the # of blocks
+// reserved.  On failure, abort
+// ============================================================================
+i32 bfsPrealloc(i32 inum, i32 fbnFirst, i32 fbnLast)
+{
+  Inode inode;
+  bfsReadInode(inum, &inode);
+  if (inode.flags & INODEEXTENTS)
+    return bfsAllocRange(inum, fbnFirst, fbnLast, 1);
+
+  // Note the holes, which get the new blocks, before filling them
+
+  i32 num = fbnLast - fbnFirst + 1;
+  i8 *hole = malloc(num);
+  if (hole == NULL)
+    FATAL(ENOMEM);
+  for (i32 f = 0; f < num; ++f)
+    hole[f] = (bfsFbnToDbn(inum, fbnFirst + f) == ENODBN);
+  i32 ret = bfsAllocRange(inum, fbnFirst, fbnLast, 0);
+
+  i8 zeros[BYTESPERBLOCK];
+  memset(zeros, 0, BYTESPERBLOCK);
+  BioVec vec[BIOVECBATCH];
+  i32 numVec = 0;
+  for (i32 f = 0; f < num; ++f)
+  {
+    if (!hole[f])
+      continue;
+    vec[numVec].dbn = bfsFbnToDbn(inum, fbnFirst + f);
+    vec[numVec].buf = zeros;
+    if (++numVec == BIOVECBATCH)
+    {
+      bioWritev(vec, numVec);
+      numVec = 0;
+    }
+  }
+  if (numVec > 0)
+    bioWritev(vec, numVec);
+  free(hole);
+  return ret;
+}
+
+// ============================================================================
+// Read FBN 'fbn' for the file whose inum is 'inum' into 'buf'.  An FBN with
+// no block is either held for delayed allocation, and copied from there, or
+// is a hole, and reads as zeros, without touching the disk
+// ============================================================================
+i32 bfsRead(i32 inum, i32 fbn, i8 *buf)
+{
+
   if (inum < 0)
     FATAL(EBADINUM);
   if (inum > MAXINUM)
     FATAL(EBADINUM);
-  if (inode == NULL)
+  if (fbn < 0)
+    FATAL(EBADFBN);
+  if (fbn >= MAXFBN)
+    FATAL(EBADFBN);
+
+  i32 dbn = bfsFbnToDbn(inum, fbn);
+  if (dbn == ENODBN)
+  {
+    i32 ofte = bfsOpenOFTE(inum);
+    i8 *blk = (ofte < 0) ? NULL : bfsDelayFind(&g_oft[ofte], fbn);
+    if (blk != NULL)
+      memcpy(buf, blk, BYTESPERBLOCK);
+    else
+      memset(buf, 0, BYTESPERBLOCK); // a hole
+    return 0;
+  }
+
+  bioRead(dbn, buf);
+  return 0;
+}
+
+// ============================================================================
+// Copy into 'fname' the name of the next entry, from position '*pos' on, in
+// the directory 'path'.  "" or "/" is the Dir itself.  Start with '*pos' = 0;
+// each call moves it beyond the entry returned.  On success, return 0.  When
+// no entries remain, return EFNF.  If 'path' does not exist, return EFNF; if
+// it is a file, ENOTDIR
+// ============================================================================
+i32 bfsReadDir(str path, i32 *pos, str fname)
+{
+
+  if (path == NULL || pos == NULL || fname == NULL)
     FATAL(ENULLPTR);
 
+  i32 dir;
+  char name[FNAMESIZE];
+  if (bfsWalkPath(path, &dir, name) != 0)
+    return EFNF;
+  if (name[0] != 0)
+  {
+    dir = bfsDirLookup(dir, name);
+    if (dir == EFNF)
+      return EFNF;
+    if (!(g_inodes[dir].flags & INODEDIR))
+      return ENOTDIR;
+  }
+
+  if (dir == ROOTINUM)
+  {
+    for (i32 inum = *pos; inum < NUMINODES; ++inum)
+    {
+      if (g_dir[inum].fname[0] != 0 && strcmp(g_dir[inum].fname, DIRLINKED))
+      {
+        strcpy(fname, g_dir[inum].fname);
+        *pos = inum + 1;
+        return 0;
+      }
+    }
+    return EFNF;
+  }
+
+  // A subdirectory: '*pos' counts Links
+
   i8 buf[BYTESPERBLOCK];
-  bioRead(DBNINODES, buf);
-  Inode *inodes = (Inode *)buf;
-  memcpy(&inodes[inum], inode, sizeof(Inode));
-  bioWrite(DBNINODES, buf);
+  Link *links = (Link *)buf;
+  i32 numLinks = bfsGetSize(dir) / BYTESPERBLOCK * LINKSPERBLOCK;
+  for (i32 k = *pos; k < numLinks; ++k)
+  {
+    if (k == *pos || k % LINKSPERBLOCK == 0)
+      bfsRead(dir, k / LINKSPERBLOCK, buf);
+    if (links[k % LINKSPERBLOCK].fname[0] != 0)
+    {
+      strcpy(fname, links[k % LINKSPERBLOCK].fname);
+      *pos = k + 1;
+      return 0;
+    }
+  }
+  return EFNF;
+}
+
+// ============================================================================
+// Called by fsRead for the bytes 'pos' to 'end' - 1 of the file open on File
+// Descriptor 'fd'.  A read that starts where the previous one on 'fd' ended
+// is sequential, so each FD is a stream of its own.  Once half of
+// what was read ahead has been consumed, the blocks up to a window beyond
+// this read are loaded into the block cache in one batch, and the window
+// doubles, from RAMIN up to RAMAX.  Any other read halves the window and
+// reads nothing ahead
+// ============================================================================
+i32 bfsReadahead(i32 fd, i64 pos, i64 end)
+{
+  FDE *e = bfsFde(fd);
+  if (__atomic_test_and_set(&e->raBusy, __ATOMIC_ACQUIRE))
+    return 0; // another thread is reading on 'fd': let it decide
+  i32 ret = bfsReadaheadRun(e, pos, end);
+  __atomic_clear(&e->raBusy, __ATOMIC_RELEASE);
+  return ret;
+}
+
+// ============================================================================
+// The body of bfsReadahead, for the stream of FD table entry 'e'
+// ============================================================================
+static i32 bfsReadaheadRun(FDE *e, i64 pos, i64 end)
+{
+  i32 inum = g_oft[e->ofte].inum;
+  i32 sequential = (pos == e->raNext);
+  e->raNext = end;
+
+  if (!sequential)
+  {
+    e->raWindow /= 2;
+    if (e->raWindow < RAMIN)
+      e->raWindow = 0;
+    e->raEnd = 0;
+    return 0;
+  }
+
+  if (e->raWindow == 0)
+    e->raWindow = RAMIN; // a new stream
+
+  i32 fbnNext = (end + BYTESPERBLOCK - 1) / BYTESPERBLOCK; // after this read
+  i32 fbnEof = (bfsGetSize(inum) + BYTESPERBLOCK - 1) / BYTESPERBLOCK;
+  if (e->raEnd < fbnNext)
+    e->raEnd = fbnNext;
+  if (e->raEnd - fbnNext > e->raWindow / 2)
+    return 0; // still well ahead of the reader
+
+  i32 fbnStop = fbnNext + e->raWindow;
+  if (fbnStop > fbnEof)
+    fbnStop = fbnEof;
+  if (fbnStop > MAXFBN)
+    fbnStop = MAXFBN;
+
+  i32 dbns[RAMAX];
+  i32 count = 0;
+  for (i32 fbn = e->raEnd; fbn < fbnStop; ++fbn)
+  {
+    i32 dbn = bfsFbnToDbn(inum, fbn);
+    if (dbn != ENODBN)
+      dbns[count++] = dbn;
+  }
+  if (fbnStop > e->raEnd)
+    e->raEnd = fbnStop;
+  if (e->raWindow < RAMAX)
+    e->raWindow *= 2; // the stream held up: read further ahead next time
+
+  return bioPrefetch(dbns, count);
+}
+
+// ============================================================================
+// Append the run of 'len' blocks from DBN 'dbn' on, holding FBNs from 'fbn'
+// on, to 'rl', growing it as needed
+// ============================================================================
+static i32 bfsRunAdd(RunList *rl, i32 fbn, i32 dbn, i32 len)
+{
+  if (rl->num == rl->max)
+  {
+    rl->max = (rl->max == 0) ? 64 : rl->max * 2;
+    rl->run = realloc(rl->run, rl->max * sizeof(Extent));
+    if (rl->run == NULL)
+      FATAL(ENOMEM);
+  }
+  Extent *r = &rl->run[rl->num++];
+  r->fbn = fbn;
+  r->dbn = dbn;
+  r->len = len;
+  return 0;
+}
+
+// ============================================================================
+// Copy the Inode whose number is 'inum' from the resident Inodes into 'inode'.
+// On success, return 0.  On failure, abort
+// ============================================================================
+i32 bfsReadInode(i32 inum, Inode *inode)
+{
+
+  if (inum < 0)
+    FATAL(EBADINUM);
+  if (inum > MAXINUM)
+    FATAL(EBADINUM);
+  if (inode == NULL)
+    FATAL(ENULLPTR);
+
+  memcpy(inode, &g_inodes[inum], sizeof(Inode));
+  return 0;
+}
+
+// ============================================================================
+// Reference file with Inode number 'inum' in the Open File Table
+// ============================================================================
+i32 bfsRefOFT(i32 inum)
+{
+  pthread_mutex_lock(&g_oftLock);
+  i32 ofte = bfsFindOFTE(inum);
+  __atomic_add_fetch(&g_oft[ofte].refs, 1, __ATOMIC_ACQ_REL);
+  pthread_mutex_unlock(&g_oftLock);
+  return 0;
+}
+
+// ============================================================================
+// Set cursor position for the file open on File Descriptor 'fd' to 'newCurs'
+// ============================================================================
+i32 bfsSetCursor(i32 fd, i64 newCurs)
+{
+  if (newCurs < 0)
+    FATAL(EBADCURS);
+
+  bfsFde(fd)->curs = newCurs;
+  return 0;
+}
+
+// ============================================================================
+// Return the cursor position for the file open on File Descriptor 'fd'
+// ============================================================================
+i64 bfsTell(i32 fd) { return bfsFde(fd)->curs; }
+
+// ============================================================================
+// Return the size of the file whose Inode number is 'inum'
+// ============================================================================
+i64 bfsGetSize(i32 inum)
+{
+
+  if (inum < 0)
+    FATAL(EBADINUM);
+  if (inum > MAXINUM)
+    FATAL(EBADINUM);
+
+  return g_inodes[inum].size;
+}
+
+// ============================================================================
+// Derive the layout of the disk from SuperBlock 'sb' into 'g_geo'.  Fields
+// that 'sb' leaves zero take the values of the original BFS disk.  Size the
+// resident Inodes and bitmap to match.  On success, return 0.  On failure,
+// abort
+// ============================================================================
+i32 bfsSetGeometry(Super *sb)
+{
+  if (sb == NULL)
+    FATAL(ENULLPTR);
+
+  Geometry geo;
+  geo.bytesPerBlock = sb->bytesPerBlock ? sb->bytesPerBlock : DEFBYTESPERBLOCK;
+  geo.numBlocks = sb->numBlocks;
+  geo.numInodes = sb->numInodes;
+  geo.dbnInodes = sb->dbnInodes ? sb->dbnInodes : 1;
+  geo.dbnDir = sb->dbnDir ? sb->dbnDir : 2;
+  geo.dbnBitmap = sb->dbnBitmap;
+  geo.numBitmap = sb->numBitmap;
+  geo.revision = sb->revision;
+
+  if (geo.revision == 1)
+  {
+    geo.inodeSize = sizeof(Inode1);
+    geo.dbnSize = sizeof(i16);
+  }
+  else if (geo.revision == 2)
+  {
+    geo.inodeSize = sizeof(Inode);
+    geo.dbnSize = sizeof(i32);
+  }
+  else
+  {
+    FATAL(EBADGEOM); // a revision we do not know
+  }
+
+  i32 bps = geo.bytesPerBlock;
+  if (bps < MINBYTESPERBLOCK || bps > MAXBYTESPERBLOCK || (bps & (bps - 1)))
+    FATAL(EBADGEOM);
+  if (geo.numBlocks <= 0 || geo.numInodes <= 0)
+    FATAL(EBADGEOM);
+  if (geo.numBlocks >= EXTENTUNWRITTEN)
+    FATAL(EBADGEOM); // DBNs must leave the EXTENTUNWRITTEN bit clear
+
+  i32 inodesPerBlock = bps / geo.inodeSize;
+  i32 direntsPerBlock = bps / sizeof(DirEnt);
+  geo.numInodeBlocks = (geo.numInodes + inodesPerBlock - 1) / inodesPerBlock;
+  geo.numDirBlocks = (geo.numInodes + direntsPerBlock - 1) / direntsPerBlock;
+  if (geo.numBitmap == 0) // Freelist: the bitmap is only held in memory
+    geo.numBitmap = (geo.numBlocks + bps * 8 - 1) / (bps * 8);
+  if ((i64)geo.numBitmap * bps * 8 < geo.numBlocks)
+    FATAL(EBADGEOM); // bitmap too small to cover the disk
+
+  if (geo.dbnInodes + geo.numInodeBlocks > geo.dbnDir)
+    FATAL(EBADGEOM);
+  if (geo.dbnDir + geo.numDirBlocks > geo.numBlocks)
+    FATAL(EBADGEOM);
+
+  // Once the Inode table has grown, inums run up to the end of its last chunk
+
+  if (sb->numChunks < 0 || sb->numChunks > NUMCHUNKS)
+    FATAL(EBADGEOM);
+  if (sb->numChunks > 0)
+  {
+    i32 base = (geo.numInodes + direntsPerBlock - 1) / direntsPerBlock *
+               direntsPerBlock;
+    geo.numInodes = base << sb->numChunks;
+  }
+
+  if (geo.revision == 1)
+  { // no double or triple indirect tables
+    geo.maxFbn = NUMDIRECT + bps / geo.dbnSize;
+  }
+  else
+  {
+    i64 n = bps / geo.dbnSize;
+    i64 max = NUMDIRECT + n + n * n + n * n * n;
+    geo.maxFbn = (max > INT32_MAX) ? INT32_MAX : max;
+  }
+
+  g_geo = geo;
+
+  for (i32 i = 0; i < NUMMAPCACHE; ++i)
+  {
+    free(g_maps[i].table);
+    g_maps[i].dbn = 0;
+    g_maps[i].dirty = 0;
+    g_maps[i].table = malloc(NUMINDIRECT * sizeof(i32));
+    if (g_maps[i].table == NULL)
+      FATAL(ENOMEM);
+  }
+
+  // The Dir hash index has a power of 2 # of slots, at least twice the #
+  // of Inodes
+
+  i32 numSlots = 16;
+  while (numSlots < 2 * NUMINODES)
+    numSlots *= 2;
+  g_dirHashMask = numSlots - 1;
+
+  free(g_inodes);
+  free(g_inodeDirty);
+  free(g_bitmap);
+  free(g_bitmapDirty);
+  free(g_freeLink);
+  g_freeLink = NULL;
+  free(g_dir);
+  free(g_dirHash);
+  free(g_inodeMap);
+  free(g_inumOfte);
+  g_inodes = calloc((i64)INODETABLEBLOCKS * INODESPERBLOCK, sizeof(Inode));
+  g_inodeDirty = calloc(INODETABLEBLOCKS, 1);
+  g_bitmap = calloc(NUMBITMAP, BYTESPERBLOCK);
+  g_bitmapDirty = calloc(NUMBITMAP, 1);
+  g_dir = calloc(DIRTABLEBLOCKS, BYTESPERBLOCK);
+  g_dirHash = malloc(numSlots * sizeof(i32));
+  g_inodeMap = malloc((NUMINODES + 63) / 64 * sizeof(u64));
+  g_inumOfte = malloc(NUMINODES * sizeof(i32));
+  if (!g_inodes || !g_inodeDirty || !g_bitmap || !g_bitmapDirty || !g_dir ||
+      !g_dirHash || !g_inodeMap || !g_inumOfte)
+    FATAL(ENOMEM);
+
+  // Files still open keep their OFTEs
+
+  memset(g_inumOfte, -1, NUMINODES * sizeof(i32));
+  for (i32 i = 0; i < NUMOFTENTRIES; ++i)
+  {
+    if (g_oft[i].refs > 0 && g_oft[i].inum < NUMINODES)
+      g_inumOfte[g_oft[i].inum] = i;
+  }
+
+  for (i32 i = 0; i < NUMDCACHE; ++i)
+    g_dcache[i].dir = -1; // forget every cached Dentry
+  return 0;
+}
+
+// ============================================================================
+// Set size of file 'inum' to 'size
+// ============================================================================
+i32 bfsSetSize(i32 inum, i64 size)
+{
+
+  if (inum < 0)
+    FATAL(EBADINUM);
+  if (inum > MAXINUM)
+    FATAL(EBADINUM);
+
+  Inode inode;
+  bfsReadInode(inum, &inode);
+
+  inode.size = size;
+  bfsWriteInode(inum, &inode);
+  return 0;
+}
+
+// ============================================================================
+// Allocate and write the blocks every open file holds for delayed
+// allocation.  Then write back every Inodes block holding a modified Inode,
+// every changed bitmap block - or the Freelist, on a disk that keeps one - and
+// indirect table, and flush the block cache
+// ============================================================================
+i32 bfsSync()
+{
+  for (i32 i = 0; i < g_oftHigh; ++i)
+  {
+    if (g_oft[i].refs > 0)
+      bfsDelayFlush(g_oft[i].inum);
+  }
+
+  for (i32 b = 0; b < INODETABLEBLOCKS; ++b)
+  {
+    if (g_inodeDirty[b])
+    {
+      bfsWriteInodeBlock(b);
+      g_inodeDirty[b] = 0;
+    }
+  }
+
+  i32 changed = 0;
+  for (i32 b = 0; b < NUMBITMAP; ++b)
+  {
+    if (g_bitmapDirty[b] && g_super.dbnBitmap != 0)
+      bioWrite(DBNBITMAP + b, (i8 *)g_bitmap + (i64)b * BYTESPERBLOCK);
+    changed |= g_bitmapDirty[b];
+    g_bitmapDirty[b] = 0;
+  }
+  if (changed && g_super.dbnBitmap == 0)
+    bfsSyncFreeList(); // the disk keeps its Freelist
+
+  bfsMapFlush();
+
+  return bioSync();
+}
+
+// ============================================================================
+// Set the size of file 'inum' to 'size'.  Growing it leaves a hole.
+// Shrinking it gives back every block beyond the new EOF - data, indirect
+// tables and extent tree nodes - marking them free in the bitmap in one
+// batch, and updating the Inode once.  Blocks the file holds for delayed
+// allocation beyond EOF are dropped, and the rest of the block holding the
+// new EOF is zeroed, so growing the file again reads zeros.  The caller
+// holds the file's lock for writing, or has the file to itself.  On
+// success, return 0
+// ============================================================================
+i32 bfsTruncate(i32 inum, i64 size)
+{
+
+  if (inum < 0)
+    FATAL(EBADINUM);
+  if (inum > MAXINUM)
+    FATAL(EBADINUM);
+  if (size < 0)
+    FATAL(EBADCURS);
+
+  if (size >= bfsGetSize(inum))
+    return bfsSetSize(inum, size);
+
+  i32 keep = (size + BYTESPERBLOCK - 1) / BYTESPERBLOCK; // FBNs kept
+  i32 ofte = bfsOpenOFTE(inum);
+  if (ofte >= 0)
+  {
+    OFTE *e = &g_oft[ofte];
+    i32 num = 0;
+    for (i32 i = 0; i < e->numDelay; ++i)
+    {
+      if (e->delayFbn[i] >= keep)
+        continue;
+      if (num != i)
+      {
+        e->delayFbn[num] = e->delayFbn[i];
+        memcpy(e->delayData + (i64)num * BYTESPERBLOCK,
+               e->delayData + (i64)i * BYTESPERBLOCK, BYTESPERBLOCK);
+      }
+      ++num;
+    }
+    e->numDelay = num;
+  }
+
+  i32 off = size % BYTESPERBLOCK;
+  if (off != 0)
+  { // zero the tail of the block holding the new EOF
+    i32 fbn = size / BYTESPERBLOCK;
+    i8 *blk = (ofte < 0) ? NULL : bfsDelayFind(&g_oft[ofte], fbn);
+    i32 dbn = bfsFbnToDbn(inum, fbn);
+    if (blk != NULL)
+    {
+      memset(blk + off, 0, BYTESPERBLOCK - off);
+    }
+    else if (dbn != ENODBN)
+    {
+      i8 buf[BYTESPERBLOCK];
+      bioRead(dbn, buf);
+      memset(buf + off, 0, BYTESPERBLOCK - off);
+      bioWrite(dbn, buf);
+    }
+  }
+
+  pthread_mutex_lock(&g_allocLock);
+  Inode inode;
+  bfsReadInode(inum, &inode);
+  RunList gone = {NULL, 0, 0};
+
+  if (inode.flags & INODEEXTENTS)
+  {
+    bfsExtentTrunc(&inode, keep, &gone);
+  }
+  else
+  {
+    for (i32 fbn = keep; fbn < NUMDIRECT; ++fbn)
+    {
+      if (inode.direct[fbn] != 0)
+        bfsRunAdd(&gone, 0, inode.direct[fbn], 1);
+      inode.direct[fbn] = 0;
+    }
+    i64 n = NUMINDIRECT;
+    bfsMapTrunc(&inode.indirect, 1, NUMDIRECT, keep, &gone);
+    bfsMapTrunc(&inode.dindirect, 2, NUMDIRECT + n, keep, &gone);
+    bfsMapTrunc(&inode.tindirect, 3, NUMDIRECT + n + n * n, keep, &gone);
+  }
+
+  inode.size = size;
+  bfsWriteInode(inum, &inode);
+  bfsMapFlush();
+  bfsFreeRuns(&gone);
+  free(gone.run);
+
+  if (ofte >= 0)
+    bfsMapForget(&g_oft[ofte]);
+  pthread_mutex_unlock(&g_allocLock);
+  return 0;
+}
+
+// ============================================================================
+// Release the file-system lock taken by bfsLock
+// ============================================================================
+i32 bfsUnlock()
+{
+  pthread_rwlock_unlock(&g_fsLock);
+  return 0;
+}
+
+// ============================================================================
+// Release the lock taken by bfsLockFile on the file open on 'fd'
+// ============================================================================
+i32 bfsUnlockFile(i32 fd)
+{
+  pthread_rwlock_unlock(&g_oft[bfsFde(fd)->ofte].lock);
+  return 0;
+}
+
+// ============================================================================
+// Unmount the BFS disk: write back everything, then close BFSDISK
+// ============================================================================
+i32 bfsUnmount()
+{
+  bfsSync();
+  return bioClose();
+}
+
+// ============================================================================
+// Walk the path 'path', such as "a/b/c", down to its last component.  Copy
+// that into 'fname' ("" if 'path' ends in '/'), and set 'dir' to the inum of
+// the directory holding it: ROOTINUM for the Dir itself.  Leading and
+// repeated '/'s are ignored.  On success, return 0.  If a directory on the
+// way does not exist, return EFNF; if it is a file, ENOTDIR; if a component
+// is too long, EBIGFNAME
+// ============================================================================
+static i32 bfsWalkPath(str path, i32 *dir, str fname)
+{
+  *dir = ROOTINUM;
+  fname[0] = 0;
+  while (*path != 0)
+  {
+    if (*path == '/')
+    {
+      ++path;
+      continue;
+    }
+
+    if (fname[0] != 0)
+    { // 'fname' is not the last component, so descend into it
+      i32 inum = bfsDirLookup(*dir, fname);
+      if (inum == EFNF)
+        return EFNF;
+      if (!(g_inodes[inum].flags & INODEDIR))
+        return ENOTDIR;
+      *dir = inum;
+    }
+
+    size_t len = strcspn(path, "/");
+    if (len > FNAMESIZE - 1)
+      return EBIGFNAME;
+    memcpy(fname, path, len);
+    fname[len] = 0;
+    path += len;
+  }
+  return 0;
+}
+
+// ============================================================================
+// Update the resident Inode 'inum' with the info in 'inode'.  It reaches the
+// disk on the next bfsSync
+// ============================================================================
+i32 bfsWriteInode(i32 inum, Inode *inode)
+{
+
+  if (inum < 0)
+    FATAL(EBADINUM);
+  if (inum > MAXINUM)
+    FATAL(EBADINUM);
+  if (inode == NULL)
+    FATAL(ENULLPTR);
+
+  memcpy(&g_inodes[inum], inode, sizeof(Inode));
+  __atomic_store_n(&g_inodeDirty[inum / INODESPERBLOCK], 1, __ATOMIC_RELAXED);
 
   return 0;
 }
@@ -5,6 +5,7 @@
 // bfs.h - API to Bothell File System
 // ===================================================================
 
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,78 +14,241 @@
 #include "bio.h"
 #include "errors.h"
 
-#define BYTESPERBLOCK 512
-#define I16SPERBLOCK 256
-#define BLOCKSPERDISK 100
-#define BYTESPERDISK (BLOCKSPERDISK * BYTESPERBLOCK)
-#define NUMINODES 8
-#define MAXINUM NUMINODES - 1
-#define NUMMETA 3
-#define MINDBN 3
+// The geometry of the disk is chosen by fsFormat and recorded in its
+// SuperBlock.  bfsMount derives the layout from there into 'g_geo', so these
+// are runtime values.  The DEF* values describe the original BFS disk
+
+#define DEFBYTESPERBLOCK 512
+#define DEFBLOCKSPERDISK 100
+#define DEFNUMINODES 8
+#define MINBYTESPERBLOCK 512   // the SuperBlock is always read as 512 bytes
+#define MAXBYTESPERBLOCK 65536 // largest block size fsFormat accepts
+#define BFSREVISION 2          // on-disk format written by fsFormat
+
+#define BYTESPERBLOCK (g_geo.bytesPerBlock)
+#define I16SPERBLOCK (BYTESPERBLOCK / 2)
+#define BLOCKSPERDISK (g_geo.numBlocks)
+#define BYTESPERDISK ((i64)BLOCKSPERDISK * BYTESPERBLOCK)
+#define NUMINODES (g_geo.numInodes)
+#define MAXINUM (NUMINODES - 1)
+#define BITSPERBLOCK (BYTESPERBLOCK * 8)
+#define NUMBITMAP (g_geo.numBitmap)
+#define NUMMETA (DBNBITMAP + NUMBITMAP)
+#define MINDBN NUMMETA
 #define BFSDISK "BFSDISK.PRE"
 #define NUMDIRECT 5
-#define NUMINDIRECT BYTESPERBLOCK / sizeof(i16)
-#define MAXFBN NUMDIRECT + NUMINDIRECT
+#define NUMINDIRECT (BYTESPERBLOCK / g_geo.dbnSize)
+#define NUMMAPFBN (NUMDIRECT + NUMINDIRECT) // FBNs in an OFTE's block map
+#define MAXFBN (g_geo.maxFbn)
 #define FNAMESIZE 16
+#define INODESPERBLOCK (BYTESPERBLOCK / g_geo.inodeSize)
+#define DIRENTSPERBLOCK ((i32)(BYTESPERBLOCK / sizeof(DirEnt)))
 
 #define DBNSUPER 0
-#define DBNINODES 1
-#define DBNDIR 2
+#define DBNINODES (g_geo.dbnInodes)
+#define NUMINODEBLOCKS (g_geo.numInodeBlocks)
+#define DBNDIR (g_geo.dbnDir)
+#define NUMDIRBLOCKS (g_geo.numDirBlocks)
+#define DBNBITMAP (g_geo.dbnBitmap)
+
+#define FDBASE 5 // File Descriptor of the first slot in the FD table
+
+#define NUMOFTENTRIES 4096 // files open at once
+#define NUMFDS 4096        // File Descriptors open at once, over all files
+
+#define RAMIN 4  // readahead window, in blocks, when a stream is detected
+#define RAMAX 32 // largest readahead window, in blocks
+
+#define NUMMAPCACHE 16 // indirect tables, of any depth, held decoded
 
-#define INUMTOFD 5
+#define NUMDELAY 64 // blocks an open file holds written, before they get DBNs
 
-#define NUMOFTENTRIES 20
+#define NUMCHUNKS 24 // times the Inode table can grow, doubling each time
+#define INODETABLEBLOCKS ((NUMINODES + INODESPERBLOCK - 1) / INODESPERBLOCK)
+#define DIRTABLEBLOCKS ((NUMINODES + DIRENTSPERBLOCK - 1) / DIRENTSPERBLOCK)
+
+// Revision 1 disks hold 16-bit DBNs and 32-bit file sizes.  Revision 2 disks
+// hold 32-bit DBNs and 64-bit file sizes.  bfsMount reads either; in memory,
+// the SuperBlock and Inodes always take the revision 2 form
+
+typedef struct
+{                    // SuperBlock, as on a revision 1 disk
+  i16 numBlocks;     // total # of blocks in BFSDISK = 1,000
+  i16 numInodes;     // total # of inodes = 8
+  i16 firstFree;     // DBN of first free block.  0 once the bitmap is in use
+  i16 dbnBitmap;     // DBN of first free-space bitmap block.  0 => Freelist
+  i16 numBitmap;     // # of free-space bitmap blocks
+  i16 bytesPerBlock; // eg: 4096.  0 => 512, as before it was configurable
+  i16 dbnInodes;     // DBN of first Inodes block.  0 => 1
+  i16 dbnDir;        // DBN of first Dir block.  0 => 2
+} Super1;
 
 typedef struct
-{                // SuperBlock
-  i16 numBlocks; // total # of blocks in BFSDISK = 1,000
-  i16 numInodes; // total # of inodes = 8
-  i16 firstFree; // DBN of first free block
+{                    // SuperBlock
+  i16 zero;          // 0.  Revision 1 keeps its non-zero numBlocks here
+  i16 revision;      // on-disk format.  eg: 2
+  i32 numBlocks;     // total # of blocks in BFSDISK
+  i32 numInodes;     // total # of inodes
+  i32 firstFree;     // DBN of first free block.  0 once the bitmap is in use
+  i32 dbnBitmap;     // DBN of first free-space bitmap block.  0 => Freelist
+  i32 numBitmap;     // # of free-space bitmap blocks
+  i32 bytesPerBlock; // eg: 4096
+  i32 dbnInodes;     // DBN of first Inodes block
+  i32 dbnDir;        // DBN of first Dir block
+  i32 flags;         // SUPER* bits
+  i32 numChunks;     // # of chunks the Inode table has grown by
+  i32 dbnChunk[NUMCHUNKS]; // DBN of each chunk: its Inodes, then its Dir
 } Super;
 
+#define SUPEREXTENTS 1 // Super.flags: new files map blocks with Extents
+
 typedef struct
-{                        // Inode
+{                     // Layout of the mounted disk, derived from its Super
+  i32 bytesPerBlock;  // eg: 512
+  i32 numBlocks;      // eg: 100
+  i32 numInodes;      // inums in use, or to be.  Grows with the Inode table
+  i32 dbnInodes;      // eg: 1
+  i32 numInodeBlocks; // laid out by fsFormat.  eg: 1
+  i32 dbnDir;         // eg: 2
+  i32 numDirBlocks;   // laid out by fsFormat.  eg: 1
+  i32 dbnBitmap;      // eg: 3
+  i32 numBitmap;      // eg: 1
+  i32 revision;       // on-disk format.  eg: 2
+  i32 inodeSize;      // bytes per Inode on disk.  eg: 64
+  i32 dbnSize;        // bytes per DBN in an indirect table.  eg: 4
+  i32 maxFbn;         // # of FBNs an Inode can map
+} Geometry;
+
+extern Geometry g_geo;
+
+typedef struct
+{                        // Inode, as on a revision 1 disk
   i32 size;              // # of bytes in file
   i16 direct[NUMDIRECT]; // DBNs for first 5 FBNs
   i16 indirect;          // DBN of the indirect table
+} Inode1;
+
+typedef struct
+{          // Extent: 'len' FBNs, from 'fbn' on, held in DBNs from 'dbn' on
+  i32 fbn; // first FBN
+  i32 dbn; // DBN holding FBN 'fbn'
+  i32 len; // # of blocks.  0 => unused
+} Extent;
+
+#define NUMEXTENTS 4   // Extents held in the Inode itself
+#define EXTENTUNWRITTEN 0x40000000 // Extent.dbn: reserved, not yet written
+#define INODEEXTENTS 1 // Inode.flags: blocks are mapped by Extents
+#define INODEDIR 2     // Inode.flags: the file is a directory, of Links
+#define EXTENTSPERNODE ((BYTESPERBLOCK - 2 * 4) / (i32)sizeof(Extent))
+
+typedef struct
+{                            // Inode
+  i64 size;                  // # of bytes in file
+  union
+  {
+    struct
+    {                        // block pointers, unless INODEEXTENTS
+      i32 direct[NUMDIRECT]; // DBNs for first 5 FBNs
+      i32 indirect;          // DBN of the indirect table
+      i32 dindirect;         // DBN of the double-indirect table
+      i32 tindirect;         // DBN of the triple-indirect table
+    };
+    Extent extent[NUMEXTENTS]; // INODEEXTENTS: sorted by FBN
+  };
+  i32 flags;                 // INODE* bits.  0 on disks before Extents
+  i32 extentBlock;           // DBN of root of extent tree.  0 => none
 } Inode;
 
 typedef struct
-{ // Dir
-  char fname[NUMINODES][FNAMESIZE];
-} Dir;
+{                        // Dir entry.  Entry 'inum' names the file 'inum'
+  char fname[FNAMESIZE]; // "" => slot is free.  DIRLINKED => in a subdirectory
+} DirEnt;
 
 typedef struct
-{           // Open File Table Entry
-  i32 inum; // inum of file. O => slot not used
-  i32 refs; // # processes fsOpen'd this file
-  i32 curs; // cursor into file
+{                        // Link: entry in a subdirectory, made by fsMkdir
+  i32 inum;              // file named
+  char fname[FNAMESIZE]; // "" => slot is free
+} Link;
+
+#define DIRLINKED "/" // Dir entry of a file named by a Link instead
+#define ROOTINUM -1   // stands for the Dir itself, as a directory
+#define LINKSPERBLOCK ((i32)(BYTESPERBLOCK / sizeof(Link)))
+#define NUMDCACHE 4096 // lookups in subdirectories remembered.  Power of 2
+#define DCACHEWAYS 4   // Dentries a lookup may occupy in g_dcache
+
+typedef struct
+{               // Open File Table Entry: one per open file, shared by its FDs
+  i32 inum;     // inum of file
+  i32 refs;     // # of File Descriptors open on this file.  0 => slot not used
+  i32 mapValid; // 1 => 'map' holds the file's current block map
+  i32 *map;     // DBN for each FBN, 0 if unmapped.  Filled on first use
+  i32 **ext;    // map beyond NUMMAPFBN: a segment per NUMINDIRECT FBNs, or NULL
+  i32 numExt;   // # of segments in 'ext'
+  i32 next;     // slot not used: index of the next free OFTE.  -1 => none
+  pthread_rwlock_t lock; // shared by readers of the file, exclusive to writers
+  i32 numDelay; // # of blocks held in 'delayData'
+  i32 *delayFbn; // FBN of each block held, which has no DBN yet
+  i8 *delayData; // NUMDELAY blocks of written data.  NULL until first used
 } OFTE;
 
-OFTE g_oft[NUMOFTENTRIES];
+typedef struct
+{               // File Descriptor Table Entry: one per fsOpen or fsCreate
+  i32 ofte;     // index of the file's OFTE.  -1 => slot not used
+  i64 curs;     // cursor into file, private to this File Descriptor
+  i64 raNext;   // cursor at which a sequential fsRead would start
+  i32 raWindow; // readahead window, in blocks.  0 => no readahead
+  i32 raEnd;    // FBN just beyond the blocks already read ahead
+  i8 raBusy;    // 1 => a thread is updating the readahead fields
+  i32 next;     // slot not used: index of the next free FDE.  -1 => none
+} FDE;
+
+extern OFTE g_oft[NUMOFTENTRIES]; // Open File Table, defined in bfs.c
 
 i32 bfsAllocBlock(i32 inum, i32 fbn);
+i32 bfsAllocRange(i32 inum, i32 fbnFirst, i32 fbnLast, i32 unwritten);
+i32 bfsCloseFd(i32 fd);
 i32 bfsCreateFile(str fname);
+i32 bfsDelayFlush(i32 inum);
+i32 bfsDelayWrite(i32 inum, i32 fbn, i32 off, i32 len, i8 *src);
+i32 bfsDeleteFile(str fname);
 i32 bfsDerefOFT(i32 inum);
-i32 bfsExtend(i32 inum, i32 fbn);
+i32 bfsDirDbn(i32 inum);
 i32 bfsFbnToDbn(i32 inum, i32 fbn);
 i32 bfsFdToInum(i32 fd);
 i32 bfsFindFreeBlock();
+i32 bfsFindFreeRun(i32 len);
 i32 bfsFindOFTE(i32 inum);
-i32 bfsGetSize(i32 inum);
+i32 bfsFreeBlock(i32 dbn);
+i64 bfsGetSize(i32 inum);
 i32 bfsInitDir();
 i32 bfsInitFreeList();
+i32 bfsInitGeometry(i32 bytesPerBlock, i32 numBlocks, i32 numInodes,
+                    i32 extents);
 i32 bfsInitInodes();
 i32 bfsInitOFT();
-i32 bfsInitSuper(FILE *fp);
-i32 bfsInumToFd(i32 inum);
+i32 bfsInitSuper();
+i32 bfsInodeDbn(i32 inum);
+i32 bfsLock(i32 exclusive);
+i32 bfsLockFile(i32 fd, i32 write);
 i32 bfsLookupFile(str fname);
+i32 bfsMakeDir(str path);
+i32 bfsMount();
+i32 bfsOpenFd(i32 inum);
+i32 bfsPrealloc(i32 inum, i32 fbnFirst, i32 fbnLast);
 i32 bfsRead(i32 inum, i32 fbn, i8 *buf);
+i32 bfsReadDir(str path, i32 *pos, str fname);
+i32 bfsReadahead(i32 fd, i64 pos, i64 end);
 i32 bfsReadInode(i32 inum, Inode *inode);
 i32 bfsRefOFT(i32 inum);
-i32 bfsSetCursor(i32 inum, i32 newCurs);
-i32 bfsSetSize(i32 inum, i32 size);
-i32 bfsTell(i32 fd);
+i32 bfsSetCursor(i32 fd, i64 newCurs);
+i32 bfsSetGeometry(Super *sb);
+i32 bfsSetSize(i32 inum, i64 size);
+i32 bfsSync();
+i64 bfsTell(i32 fd);
+i32 bfsTruncate(i32 inum, i64 size);
+i32 bfsUnlock();
+i32 bfsUnlockFile(i32 fd);
+i32 bfsUnmount();
 i32 bfsWriteInode(i32 inum, Inode *inode);
 
 #endif
\ No newline at end of file
@@ -1,10 +1,657 @@
 // ============================================================================
 // bio.c - low level Block IO functions
+//
+// Blocks pass through a fixed-size write-back cache.  Each cached block lives
+// in a BioBuf slot, found by hashing its DBN, and the slots are kept on a
+// doubly linked list in least-recently-used order.  A miss claims a free slot,
+// or evicts the LRU slot, writing it back first if it is dirty.
+//
+// A large cache is split into shards, each with its own lock, slots, hash
+// chains and LRU list, so threads using different blocks rarely contend.
+// Every BIOSHARDRUN consecutive DBNs fall in the same shard
+//
+// BFSDISK is kept sparse.  A run of all-zero blocks is punched out of it as a
+// hole, rather than written, and so are blocks the file system frees
 // ============================================================================
 
+#define _GNU_SOURCE // for fallocate
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
 #include "bfs.h"
 #include "bio.h"
 
+#define NIL -1 // end of an LRU list or hash chain
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024 // most buffers one preadv/pwritev accepts
+#endif
+
+typedef struct
+{            // Cached block
+  i32 dbn;   // DBN held in this slot, or NIL if unused
+  i32 dirty; // 1 => modified since read from BFSDISK
+  i32 prev;  // neighbour towards most-recently-used
+  i32 next;  // neighbour towards least-recently-used
+  i32 hnext; // next slot in the same hash chain
+} BioBuf;
+
+typedef struct
+{                       // Shard: part of the cache, under a lock of its own
+  pthread_mutex_t lock; // held while using any other field
+  BioBuf *bufs;         // slot headers
+  i8 *data;             // slot data, BYTESPERBLOCK each
+  i32 *hash;            // heads of the hash chains
+  i32 hashMask;         // # of hash chains - 1
+  i32 mru;              // most-recently-used slot
+  i32 lru;              // least-recently-used slot
+  i32 numBufs;          // slots allocated for this mount.  0 => no caching
+  i32 numUsed;          // slots holding a block
+  BioStats stats;       // counters for the blocks of this shard
+} BioShard;
+
+static i32 g_fd = -1; // descriptor for BFSDISK while mounted
+static char g_disk[FILENAME_MAX] = BFSDISK; // host file holding the disk
+
+static i32 g_cacheCap = BIOCACHEBLOCKS; // configured capacity, in blocks
+static i32 g_numBufs = 0;               // slots allocated for this mount
+static BioShard g_shards[BIOMAXSHARDS];
+static i32 g_numShards = 0;  // shards in use while BFSDISK is open
+static i32 g_locksReady = 0; // 1 => shard locks initialized
+static BioStats g_stats;     // counters of the shards already released
+static i32 g_canPunch = 1;   // 0 => the host cannot punch holes in BFSDISK
+
+static i32 bioCacheFree();
+static i32 bioCacheInit();
+static int bioCmpVec(const void *a, const void *b);
+
+// ============================================================================
+// Physical IO on BFSDISK, bypassing the cache.  Counted in shard 'sh'
+// ============================================================================
+static i32 bioPread(BioShard *sh, i32 dbn, void *buf)
+{
+  off_t boff = (off_t)dbn * BYTESPERBLOCK;
+  ssize_t numb = pread(g_fd, buf, BYTESPERBLOCK, boff);
+  if (numb != BYTESPERBLOCK)
+    FATAL(EBADREAD);
+  ++sh->stats.reads;
+  ++sh->stats.ios;
+  return 0;
+}
+
+static i32 bioPwrite(BioShard *sh, i32 dbn, void *buf)
+{
+  off_t boff = (off_t)dbn * BYTESPERBLOCK;
+  ssize_t numb = pwrite(g_fd, buf, BYTESPERBLOCK, boff);
+  if (numb != BYTESPERBLOCK)
+    FATAL(EBADWRITE);
+  ++sh->stats.writes;
+  ++sh->stats.ios;
+  return 0;
+}
+
+// ============================================================================
+// Punch the 'count' blocks from 'dbn' out of BFSDISK, leaving a hole that
+// reads as zeros and takes no space on the host.  Counted in shard 'sh'.
+// Return 1 if punched, or 0 if the host cannot punch holes
+// ============================================================================
+static i32 bioPunch(BioShard *sh, i32 dbn, i32 count)
+{
+#ifdef FALLOC_FL_PUNCH_HOLE
+  if (g_canPunch)
+  {
+    off_t boff = (off_t)dbn * BYTESPERBLOCK;
+    off_t len = (off_t)count * BYTESPERBLOCK;
+    if (fallocate(g_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, boff,
+                  len) == 0)
+    {
+      sh->stats.punched += count;
+      ++sh->stats.ios;
+      return 1;
+    }
+    g_canPunch = 0; // not supported here: don't ask again
+  }
+#endif
+  return 0;
+}
+
+// ============================================================================
+// Read ('write' = 0) or write ('write' = 1) the 'count' blocks of 'vec', whose
+// DBNs are consecutive, with as few preadv/pwritev calls as IOV_MAX allows.
+// Counted in shard 'sh'
+// ============================================================================
+static i32 bioRunIO(BioShard *sh, i32 write, BioVec *vec, i32 count)
+{
+  while (count > 0)
+  {
+    i32 n = (count < IOV_MAX) ? count : IOV_MAX;
+    struct iovec iov[n];
+    for (i32 i = 0; i < n; ++i)
+    {
+      iov[i].iov_base = vec[i].buf;
+      iov[i].iov_len = BYTESPERBLOCK;
+    }
+
+    off_t boff = (off_t)vec[0].dbn * BYTESPERBLOCK;
+    ssize_t want = (ssize_t)n * BYTESPERBLOCK;
+    if (write)
+    {
+      if (pwritev(g_fd, iov, n, boff) != want)
+        FATAL(EBADWRITE);
+      sh->stats.writes += n;
+    }
+    else
+    {
+      if (preadv(g_fd, iov, n, boff) != want)
+        FATAL(EBADREAD);
+      sh->stats.reads += n;
+    }
+    ++sh->stats.ios;
+
+    vec += n;
+    count -= n;
+  }
+  return 0;
+}
+
+// ============================================================================
+// Return the length of the run of consecutive DBNs at the start of 'vec'
+// ============================================================================
+static i32 bioRunLength(BioVec *vec, i32 count)
+{
+  i32 n = 1;
+  while (n < count && vec[n].dbn == vec[n - 1].dbn + 1)
+    ++n;
+  return n;
+}
+
+// ============================================================================
+// Write the 'count' blocks of 'vec', whose DBNs are consecutive, as bioRunIO
+// does, except that each run of at least BIOPUNCHRUN all-zero blocks is
+// punched out of BFSDISK instead.  Shorter runs of zeros are written along
+// with their neighbours, since punching them would free no host space and
+// split one pwritev into several calls.  Counted in shard 'sh'
+// ============================================================================
+static i32 bioWriteRun(BioShard *sh, BioVec *vec, i32 count)
+{
+  i32 first = 0; // first block not yet written
+  for (i32 i = 0; i < count;)
+  {
+    if (!bioIsZero(vec[i].buf))
+    {
+      ++i;
+      continue;
+    }
+    i32 z = i + 1;
+    while (z < count && bioIsZero(vec[z].buf))
+      ++z;
+    if (z - i >= BIOPUNCHRUN && bioPunch(sh, vec[i].dbn, z - i))
+    {
+      if (i > first)
+        bioRunIO(sh, 1, vec + first, i - first);
+      first = z;
+    }
+    i = z;
+  }
+  if (count > first)
+    bioRunIO(sh, 1, vec + first, count - first);
+  return 0;
+}
+
+// ============================================================================
+// Return the shard caching 'dbn'
+// ============================================================================
+static BioShard *bioShard(i32 dbn)
+{
+  return &g_shards[(u32)(dbn / BIOSHARDRUN) % g_numShards];
+}
+
+// ============================================================================
+// Return the length of the run of entries at the start of 'vec' whose blocks
+// belong to the same shard
+// ============================================================================
+static i32 bioShardRun(BioVec *vec, i32 count)
+{
+  BioShard *sh = bioShard(vec[0].dbn);
+  i32 n = 1;
+  while (n < count && bioShard(vec[n].dbn) == sh)
+    ++n;
+  return n;
+}
+
+// ============================================================================
+// Return the data of slot 's'
+// ============================================================================
+static i8 *bioSlotData(BioShard *sh, i32 s)
+{
+  return sh->data + (i64)s * BYTESPERBLOCK;
+}
+
+// ============================================================================
+// Return the hash chain for 'dbn'
+// ============================================================================
+static i32 bioHash(BioShard *sh, i32 dbn)
+{
+  return (dbn * 2654435761u) & sh->hashMask;
+}
+
+// ============================================================================
+// Unlink slot 's' from the LRU list
+// ============================================================================
+static void bioUnlink(BioShard *sh, i32 s)
+{
+  BioBuf *b = &sh->bufs[s];
+  if (b->prev != NIL)
+    sh->bufs[b->prev].next = b->next;
+  else
+    sh->mru = b->next;
+  if (b->next != NIL)
+    sh->bufs[b->next].prev = b->prev;
+  else
+    sh->lru = b->prev;
+  b->prev = b->next = NIL;
+}
+
+// ============================================================================
+// Link slot 's', which is on no list, in as the most-recently-used
+// ============================================================================
+static void bioPushMru(BioShard *sh, i32 s)
+{
+  BioBuf *b = &sh->bufs[s];
+  b->prev = NIL;
+  b->next = sh->mru;
+  if (sh->mru != NIL)
+    sh->bufs[sh->mru].prev = s;
+  sh->mru = s;
+  if (sh->lru == NIL)
+    sh->lru = s;
+}
+
+// ============================================================================
+// Link slot 's', which is on no list, in as the least-recently-used
+// ============================================================================
+static void bioPushLru(BioShard *sh, i32 s)
+{
+  BioBuf *b = &sh->bufs[s];
+  b->next = NIL;
+  b->prev = sh->lru;
+  if (sh->lru != NIL)
+    sh->bufs[sh->lru].next = s;
+  sh->lru = s;
+  if (sh->mru == NIL)
+    sh->mru = s;
+}
+
+// ============================================================================
+// Make slot 's' the most-recently-used
+// ============================================================================
+static void bioTouch(BioShard *sh, i32 s)
+{
+  if (sh->mru == s)
+    return;
+  bioUnlink(sh, s);
+  bioPushMru(sh, s);
+}
+
+// ============================================================================
+// Find 'dbn' in the cache.  Return its slot, or NIL if not cached
+// ============================================================================
+static i32 bioLookup(BioShard *sh, i32 dbn)
+{
+  for (i32 s = sh->hash[bioHash(sh, dbn)]; s != NIL; s = sh->bufs[s].hnext)
+  {
+    if (sh->bufs[s].dbn == dbn)
+      return s;
+  }
+  return NIL;
+}
+
+// ============================================================================
+// Remove slot 's' from its hash chain
+// ============================================================================
+static void bioUnhash(BioShard *sh, i32 s)
+{
+  i32 *link = &sh->hash[bioHash(sh, sh->bufs[s].dbn)];
+  while (*link != s)
+    link = &sh->bufs[*link].hnext;
+  *link = sh->bufs[s].hnext;
+  sh->bufs[s].hnext = NIL;
+}
+
+// ============================================================================
+// Claim a slot for 'dbn', which is not cached.  Use an unused slot if there
+// is one; otherwise evict the LRU block, writing it back if dirty.  The slot
+// is returned hashed, clean and most-recently-used; its data is undefined
+// ============================================================================
+static i32 bioClaim(BioShard *sh, i32 dbn)
+{
+  i32 s;
+  if (sh->numUsed < sh->numBufs)
+  {
+    s = sh->numUsed++;
+  }
+  else
+  {
+    s = sh->lru;
+    if (sh->bufs[s].dirty)
+      bioPwrite(sh, sh->bufs[s].dbn, bioSlotData(sh, s));
+    bioUnhash(sh, s);
+    bioUnlink(sh, s);
+  }
+
+  BioBuf *b = &sh->bufs[s];
+  b->dbn = dbn;
+  b->dirty = 0;
+  i32 h = bioHash(sh, dbn);
+  b->hnext = sh->hash[h];
+  sh->hash[h] = s;
+  bioPushMru(sh, s);
+  return s;
+}
+
+// ============================================================================
+// Allocate the cache for a newly opened BFSDISK.  A cache of more than
+// BIOSHARDBLOCKS blocks is split into shards of about that many, up to
+// BIOMAXSHARDS.  With caching disabled there is a single, empty shard
+// ============================================================================
+static i32 bioCacheInit()
+{
+  bioCacheFree();
+
+  if (!g_locksReady)
+  {
+    for (i32 i = 0; i < BIOMAXSHARDS; ++i)
+      pthread_mutex_init(&g_shards[i].lock, NULL);
+    g_locksReady = 1;
+  }
+
+  i32 numShards = g_cacheCap / BIOSHARDBLOCKS;
+  if (numShards < 1)
+    numShards = 1;
+  if (numShards > BIOMAXSHARDS)
+    numShards = BIOMAXSHARDS;
+
+  for (i32 i = 0; i < numShards; ++i)
+  {
+    BioShard *sh = &g_shards[i];
+    i32 numBufs = g_cacheCap / numShards + (i < g_cacheCap % numShards);
+    memset(&sh->stats, 0, sizeof(BioStats));
+    sh->numBufs = numBufs;
+    sh->numUsed = 0;
+    sh->mru = sh->lru = NIL;
+    if (numBufs == 0)
+      continue; // caching disabled
+
+    i32 numHash = 1;
+    while (numHash < 2 * numBufs)
+      numHash <<= 1;
+
+    sh->bufs = malloc(numBufs * sizeof(BioBuf));
+    sh->data = malloc((i64)numBufs * BYTESPERBLOCK);
+    sh->hash = malloc(numHash * sizeof(i32));
+    if (sh->bufs == NULL || sh->data == NULL || sh->hash == NULL)
+      FATAL(ENOMEM);
+
+    for (i32 s = 0; s < numBufs; ++s)
+    {
+      sh->bufs[s].dbn = NIL;
+      sh->bufs[s].dirty = 0;
+      sh->bufs[s].prev = sh->bufs[s].next = sh->bufs[s].hnext = NIL;
+    }
+    for (i32 h = 0; h < numHash; ++h)
+      sh->hash[h] = NIL;
+    sh->hashMask = numHash - 1;
+  }
+
+  g_numShards = numShards;
+  g_numBufs = g_cacheCap;
+  return 0;
+}
+
+// ============================================================================
+// Add the counters of 'from' to 'to'
+// ============================================================================
+static void bioAddStats(BioStats *to, BioStats *from)
+{
+  to->hits += from->hits;
+  to->misses += from->misses;
+  to->reads += from->reads;
+  to->writes += from->writes;
+  to->ios += from->ios;
+  to->prefetched += from->prefetched;
+  to->punched += from->punched;
+}
+
+// ============================================================================
+// Write back, then release, the cache.  Its counters carry on in g_stats
+// ============================================================================
+static i32 bioCacheFree()
+{
+  if (g_numShards > 0 && g_fd >= 0)
+    bioSync();
+
+  for (i32 i = 0; i < g_numShards; ++i)
+  {
+    BioShard *sh = &g_shards[i];
+    bioAddStats(&g_stats, &sh->stats);
+    free(sh->bufs);
+    free(sh->data);
+    free(sh->hash);
+    sh->bufs = NULL;
+    sh->data = NULL;
+    sh->hash = NULL;
+    sh->numBufs = 0;
+    sh->numUsed = 0;
+    sh->mru = sh->lru = NIL;
+  }
+  g_numShards = 0;
+  g_numBufs = 0;
+  return 0;
+}
+
+// ============================================================================
+// Close the BFS disk, writing back any dirty blocks first.  Safe to call when
+// it is not open
+// ============================================================================
+i32 bioClose()
+{
+  if (g_fd < 0)
+    return 0;
+
+  bioCacheFree();
+
+  i32 ret = close(g_fd);
+  g_fd = -1;
+  if (ret != 0)
+    FATAL(EBADWRITE);
+  return 0;
+}
+
+// ============================================================================
+// Create the BFS disk, discarding any previous contents, and leave it open
+// for subsequent block IO.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 bioCreate()
+{
+  bioClose();
+
+  g_fd = open(g_disk, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (g_fd < 0)
+    FATAL(EDISKCREATE);
+  if (ftruncate(g_fd, (off_t)BYTESPERDISK) != 0)
+    FATAL(EDISKCREATE); // size the disk; blocks read as zero until written
+  return bioCacheInit();
+}
+
+// ============================================================================
+// Forget the 'count' blocks from 'dbn', which the file system has freed.
+// Cached copies are made clean, so they are never written back, and least-
+// recently-used, so their slots are reused first.  A run of at least
+// BIOPUNCHRUN blocks is also punched out of BFSDISK, giving its space back
+// to the host.  The contents of the blocks are undefined from now on
+// ============================================================================
+i32 bioDiscard(i32 dbn, i32 count)
+{
+  if (dbn < 0 || count < 0 || count > BLOCKSPERDISK - dbn)
+    FATAL(EBADDBN);
+  if (g_fd < 0)
+    FATAL(ENODISK);
+
+  i32 end = dbn + count;
+  for (i32 d = dbn; d < end;)
+  {
+    i32 next = (d / BIOSHARDRUN + 1) * BIOSHARDRUN; // where the shard changes
+    if (next > end)
+      next = end;
+    BioShard *sh = bioShard(d);
+    pthread_mutex_lock(&sh->lock);
+    for (i32 x = d; x < next && sh->numBufs > 0; ++x)
+    {
+      i32 s = bioLookup(sh, x);
+      if (s == NIL)
+        continue;
+      sh->bufs[s].dirty = 0;
+      bioUnlink(sh, s);
+      bioPushLru(sh, s);
+    }
+    pthread_mutex_unlock(&sh->lock);
+    d = next;
+  }
+
+  if (count >= BIOPUNCHRUN)
+  {
+    BioShard *sh = bioShard(dbn);
+    pthread_mutex_lock(&sh->lock);
+    bioPunch(sh, dbn, count);
+    pthread_mutex_unlock(&sh->lock);
+  }
+  return 0;
+}
+
+// ============================================================================
+// Copy the cache counters into 'stats'
+// ============================================================================
+i32 bioGetStats(BioStats *stats)
+{
+  if (stats == NULL)
+    FATAL(ENULLPTR);
+
+  *stats = g_stats;
+  for (i32 i = 0; i < g_numShards; ++i)
+  {
+    BioShard *sh = &g_shards[i];
+    pthread_mutex_lock(&sh->lock);
+    bioAddStats(stats, &sh->stats);
+    pthread_mutex_unlock(&sh->lock);
+  }
+  return 0;
+}
+
+// ============================================================================
+// Return 1 if the BYTESPERBLOCK bytes at 'buf' are all zero, else 0.  The
+// block is OR-ed together 64 bytes at a time, a stride the compiler turns
+// into vector instructions, and the scan stops at the first chunk holding a
+// non-zero byte, so a block of data is usually rejected at once
+// ============================================================================
+i32 bioIsZero(void *buf)
+{
+  const i8 *p = buf;
+  for (i32 i = 0; i < BYTESPERBLOCK; i += 64)
+  {
+    u64 w[8];
+    memcpy(w, p + i, sizeof(w)); // 'buf' need not be aligned
+    u64 acc = 0;
+    for (i32 j = 0; j < 8; ++j)
+      acc |= w[j];
+    if (acc != 0)
+      return 0;
+  }
+  return 1;
+}
+
+// ============================================================================
+// Open the existing BFS disk, and keep it open until bioClose.  On success,
+// return 0.  On failure, abort
+// ============================================================================
+i32 bioOpen()
+{
+  bioClose();
+
+  g_fd = open(g_disk, O_RDWR);
+  if (g_fd < 0)
+    FATAL(ENODISK); // BFSDISK not found
+  return bioCacheInit();
+}
+
+// ============================================================================
+// Load the blocks 'dbns' into the cache, ahead of their being read.  Blocks
+// already cached are skipped; the rest are read with one preadv per run of
+// consecutive DBNs.  'dbns' is sorted.  At most half the cache, and half of
+// any one shard, is filled by one call, so a batch never evicts its own
+// blocks
+// ============================================================================
+i32 bioPrefetch(i32 *dbns, i32 count)
+{
+  if (dbns == NULL)
+    FATAL(ENULLPTR);
+  if (g_fd < 0)
+    FATAL(ENODISK);
+  if (g_numBufs == 0)
+    return 0;
+
+  i32 max = g_numBufs / 2;
+  if (count > max)
+    count = max;
+
+  BioVec vec[count > 0 ? count : 1];
+  for (i32 i = 0; i < count; ++i)
+  {
+    if (dbns[i] < 0 || dbns[i] >= BLOCKSPERDISK)
+      FATAL(EBADDBN);
+    vec[i].dbn = dbns[i];
+    vec[i].buf = NULL;
+  }
+  qsort(vec, count, sizeof(BioVec), bioCmpVec);
+
+  for (i32 first = 0; first < count;)
+  {
+    i32 n = bioShardRun(vec + first, count - first);
+    BioVec *run = vec + first;
+    BioShard *sh = bioShard(run[0].dbn);
+    pthread_mutex_lock(&sh->lock);
+
+    i32 numVec = 0;
+    for (i32 i = 0; i < n && numVec < sh->numBufs / 2; ++i)
+    {
+      i32 dbn = run[i].dbn;
+      if (bioLookup(sh, dbn) != NIL)
+        continue;
+      if (numVec > 0 && run[numVec - 1].dbn == dbn)
+        continue; // repeated
+      i32 s = bioClaim(sh, dbn);
+      run[numVec].dbn = dbn;
+      run[numVec].buf = bioSlotData(sh, s);
+      ++numVec;
+    }
+
+    for (i32 i = 0; i < numVec;)
+    {
+      i32 len = bioRunLength(run + i, numVec - i);
+      bioRunIO(sh, 0, run + i, len);
+      i += len;
+    }
+    sh->stats.prefetched += numVec;
+
+    pthread_mutex_unlock(&sh->lock);
+    first += n;
+  }
+  return 0;
+}
+
 // ============================================================================
 // Read 512 bytes from block number 'dbn' in the BFS disk into buffer 'buf'
 // ============================================================================
@@ -12,58 +659,316 @@ i32 bioRead(i32 dbn, void *buf)
 {
   if (dbn < 0)
     FATAL(EBADDBN);
-  if (dbn > BLOCKSPERDISK)
+  if (dbn >= BLOCKSPERDISK)
     FATAL(EBADDBN);
-
-  FILE *fp = fopen(BFSDISK, "rb+");
-  if (fp == NULL)
+  if (g_fd < 0)
     FATAL(ENODISK);
 
-  i32 boff = dbn * BYTESPERBLOCK;
-  i32 ret = fseek(fp, boff, SEEK_SET);
-  if (ret != 0)
+  BioShard *sh = bioShard(dbn);
+  pthread_mutex_lock(&sh->lock);
+
+  if (sh->numBufs == 0)
   {
-    fclose(fp);
-    FATAL(ret);
+    bioPread(sh, dbn, buf);
+    pthread_mutex_unlock(&sh->lock);
+    return 0;
   }
 
-  i32 numb = fread(buf, 1, BYTESPERBLOCK, fp);
-  if (numb != BYTESPERBLOCK)
+  i32 s = bioLookup(sh, dbn);
+  if (s != NIL)
   {
-    fclose(fp);
-    FATAL(EBADREAD);
+    ++sh->stats.hits;
+    bioTouch(sh, s);
+  }
+  else
+  {
+    ++sh->stats.misses;
+    s = bioClaim(sh, dbn);
+    bioPread(sh, dbn, bioSlotData(sh, s));
   }
 
-  fclose(fp);
+  memcpy(buf, bioSlotData(sh, s), BYTESPERBLOCK);
+  pthread_mutex_unlock(&sh->lock);
   return 0;
 }
 
 // ============================================================================
-// Write 512 bytes from 'buf' into block number 'dbn' of the BFS disk
+// Compare BioVecs by DBN, for qsort
 // ============================================================================
-i32 bioWrite(i32 dbn, void *buf)
+static int bioCmpVec(const void *a, const void *b)
 {
+  i32 da = ((const BioVec *)a)->dbn;
+  i32 db = ((const BioVec *)b)->dbn;
+  return (da > db) - (da < db);
+}
 
-  FILE *fp = fopen(BFSDISK, "rb+");
-  if (fp == NULL)
+// ============================================================================
+// Check, then sort by DBN, the 'count' blocks of a vectored transfer
+// ============================================================================
+static i32 bioSortVec(BioVec *vec, i32 count)
+{
+  if (vec == NULL)
+    FATAL(ENULLPTR);
+  if (count < 0)
+    FATAL(ENEGNUMB);
+  if (g_fd < 0)
     FATAL(ENODISK);
 
-  i32 boff = dbn * BYTESPERBLOCK;
-  i32 ret = fseek(fp, boff, SEEK_SET);
-  if (ret != 0)
+  for (i32 i = 0; i < count; ++i)
   {
-    fclose(fp);
-    FATAL(ret);
+    if (vec[i].dbn < 0 || vec[i].dbn >= BLOCKSPERDISK)
+      FATAL(EBADDBN);
+    if (vec[i].buf == NULL)
+      FATAL(ENULLPTR);
   }
 
-  i32 numb = fwrite(buf, 1, BYTESPERBLOCK, fp);
-  if (numb != BYTESPERBLOCK)
+  qsort(vec, count, sizeof(BioVec), bioCmpVec);
+  return 0;
+}
+
+// ============================================================================
+// Read each block 'vec[i].dbn' into 'vec[i].buf'.  The entries are sorted by
+// DBN (so 'vec' is reordered).  Cached blocks are copied from the cache; the
+// rest are read straight into the callers' buffers, one preadv per run of
+// consecutive DBNs within a shard.  Blocks read this way are not added to the
+// cache, so a large read does not flush it
+// ============================================================================
+i32 bioReadv(BioVec *vec, i32 count)
+{
+  bioSortVec(vec, count);
+
+  for (i32 first = 0; first < count;)
+  {
+    i32 last = first + bioShardRun(vec + first, count - first);
+    BioShard *sh = bioShard(vec[first].dbn);
+    pthread_mutex_lock(&sh->lock);
+
+    i32 i = first;
+    while (i < last)
+    {
+      i32 s = (sh->numBufs > 0) ? bioLookup(sh, vec[i].dbn) : NIL;
+      if (s != NIL)
+      {
+        ++sh->stats.hits;
+        bioTouch(sh, s);
+        memcpy(vec[i].buf, bioSlotData(sh, s), BYTESPERBLOCK);
+        ++i;
+        continue;
+      }
+
+      // Extend a run of uncached, consecutive DBNs
+
+      i32 n = 1;
+      while (i + n < last && vec[i + n].dbn == vec[i + n - 1].dbn + 1 &&
+             (sh->numBufs == 0 || bioLookup(sh, vec[i + n].dbn) == NIL))
+        ++n;
+
+      if (sh->numBufs > 0)
+        sh->stats.misses += n;
+      bioRunIO(sh, 0, vec + i, n);
+      i += n;
+    }
+
+    pthread_mutex_unlock(&sh->lock);
+    first = last;
+  }
+  return 0;
+}
+
+// ============================================================================
+// Zero the cache counters
+// ============================================================================
+i32 bioResetStats()
+{
+  memset(&g_stats, 0, sizeof(BioStats));
+  for (i32 i = 0; i < g_numShards; ++i)
   {
-    fclose(fp);
+    BioShard *sh = &g_shards[i];
+    pthread_mutex_lock(&sh->lock);
+    memset(&sh->stats, 0, sizeof(BioStats));
+    pthread_mutex_unlock(&sh->lock);
+  }
+  return 0;
+}
+
+// ============================================================================
+// Set the capacity of the block cache to 'numBlocks'.  0 disables caching.
+// Takes effect immediately if BFSDISK is open, else on the next open.  No
+// other thread may be doing block IO meanwhile
+// ============================================================================
+i32 bioSetCacheSize(i32 numBlocks)
+{
+  if (numBlocks < 0)
+    FATAL(ENEGNUMB);
+
+  g_cacheCap = numBlocks;
+  if (g_fd >= 0)
+    bioCacheInit();
+  return 0;
+}
+
+// ============================================================================
+// Keep the BFS disk in host file 'fname' instead of BFSDISK.  Takes effect on
+// the next bioCreate or bioOpen.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 bioSetDisk(str fname)
+{
+  if (fname == NULL)
+    FATAL(ENULLPTR);
+  if (strlen(fname) >= FILENAME_MAX)
+    FATAL(EBIGFNAME);
+
+  strcpy(g_disk, fname);
+  return 0;
+}
+
+// ============================================================================
+// Compare slots by DBN, for qsort.  Each entry packs the shard number above
+// the slot number
+// ============================================================================
+static int bioCmpSlot(const void *a, const void *b)
+{
+  i64 sa = *(const i64 *)a;
+  i64 sb = *(const i64 *)b;
+  i32 da = g_shards[sa >> 32].bufs[(i32)sa].dbn;
+  i32 db = g_shards[sb >> 32].bufs[(i32)sb].dbn;
+  return (da > db) - (da < db);
+}
+
+// ============================================================================
+// Write every dirty block back to BFSDISK, shard by shard, in ascending DBN
+// order, then ask the host to make them durable.  Runs of adjacent DBNs are
+// coalesced, and long runs of zeros punched as holes
+// ============================================================================
+i32 bioSync()
+{
+  if (g_fd < 0)
+    FATAL(ENODISK);
+
+  for (i32 k = 0; k < g_numShards; ++k)
+  {
+    BioShard *sh = &g_shards[k];
+    if (sh->numBufs == 0)
+      continue;
+    pthread_mutex_lock(&sh->lock);
+
+    i64 *dirty = malloc(sh->numBufs * sizeof(i64));
+    BioVec *vec = malloc(sh->numBufs * sizeof(BioVec));
+    if (dirty == NULL || vec == NULL)
+      FATAL(ENOMEM);
+
+    i32 numDirty = 0;
+    for (i32 s = 0; s < sh->numUsed; ++s)
+    {
+      if (sh->bufs[s].dirty)
+        dirty[numDirty++] = ((i64)k << 32) | s;
+    }
+
+    qsort(dirty, numDirty, sizeof(i64), bioCmpSlot);
+
+    for (i32 i = 0; i < numDirty; ++i)
+    {
+      i32 s = (i32)dirty[i];
+      vec[i].dbn = sh->bufs[s].dbn;
+      vec[i].buf = bioSlotData(sh, s);
+      sh->bufs[s].dirty = 0;
+    }
+
+    for (i32 i = 0; i < numDirty;)
+    { // adjacent dirty blocks go out in one pwritev
+      i32 n = bioRunLength(vec + i, numDirty - i);
+      bioWriteRun(sh, vec + i, n);
+      i += n;
+    }
+
+    free(vec);
+    free(dirty);
+    pthread_mutex_unlock(&sh->lock);
+  }
+
+  if (fsync(g_fd) != 0)
     FATAL(EBADWRITE);
+  return 0;
+}
+
+// ============================================================================
+// Write 512 bytes from 'buf' into block number 'dbn' of the BFS disk.  The
+// block is cached dirty, and reaches BFSDISK on eviction or bioSync
+// ============================================================================
+i32 bioWrite(i32 dbn, void *buf)
+{
+  if (dbn < 0)
+    FATAL(EBADDBN);
+  if (dbn >= BLOCKSPERDISK)
+    FATAL(EBADDBN);
+  if (g_fd < 0)
+    FATAL(ENODISK);
+
+  BioShard *sh = bioShard(dbn);
+  pthread_mutex_lock(&sh->lock);
+
+  if (sh->numBufs == 0)
+  {
+    bioPwrite(sh, dbn, buf);
+    pthread_mutex_unlock(&sh->lock);
+    return 0;
+  }
+
+  i32 s = bioLookup(sh, dbn);
+  if (s != NIL)
+  {
+    ++sh->stats.hits;
+    bioTouch(sh, s);
+  }
+  else
+  {
+    ++sh->stats.misses;
+    s = bioClaim(sh, dbn); // whole block is overwritten, so no read needed
   }
 
-  fclose(fp);
+  memcpy(bioSlotData(sh, s), buf, BYTESPERBLOCK);
+  sh->bufs[s].dirty = 1;
+  pthread_mutex_unlock(&sh->lock);
+  return 0;
+}
 
+// ============================================================================
+// Write each block 'vec[i].buf' into DBN 'vec[i].dbn'.  The entries are sorted
+// by DBN (so 'vec' is reordered), and must not repeat a DBN.  Runs of
+// consecutive DBNs within a shard go to BFSDISK in one pwritev each, less any
+// long runs of zeros, which are punched as holes.  Any cached copy is
+// refreshed, and is clean once written
+// ============================================================================
+i32 bioWritev(BioVec *vec, i32 count)
+{
+  bioSortVec(vec, count);
+
+  for (i32 first = 0; first < count;)
+  {
+    i32 last = first + bioShardRun(vec + first, count - first);
+    BioShard *sh = bioShard(vec[first].dbn);
+    pthread_mutex_lock(&sh->lock);
+
+    for (i32 i = first; i < last && sh->numBufs > 0; ++i)
+    {
+      i32 s = bioLookup(sh, vec[i].dbn);
+      if (s == NIL)
+        continue;
+      ++sh->stats.hits;
+      bioTouch(sh, s);
+      memcpy(bioSlotData(sh, s), vec[i].buf, BYTESPERBLOCK);
+      sh->bufs[s].dirty = 0;
+    }
+
+    for (i32 i = first; i < last;)
+    {
+      i32 n = bioRunLength(vec + i, last - i);
+      bioWriteRun(sh, vec + i, n);
+      i += n;
+    }
+
+    pthread_mutex_unlock(&sh->lock);
+    first = last;
+  }
   return 0;
 }
@@ -10,7 +10,42 @@
 
 #include "alias.h"
 
-i32 bioRead (i32 dbn, void* buf);
-i32 bioWrite(i32 dbn, void* buf);
+#define BIOCACHEBLOCKS 64     // default capacity of the block cache
+#define BIOVECBATCH    64     // BioVecs a caller gathers per bioReadv/Writev
+#define BIOSHARDBLOCKS 256    // cache blocks per lock, in a large cache
+#define BIOMAXSHARDS   16     // most parts a large cache is split into
+#define BIOSHARDRUN    64     // consecutive DBNs cached in the same part
+#define BIOPUNCHRUN    8      // fewest zero blocks punched as a host hole
 
-#endif
\ No newline at end of file
+typedef struct {              // One block of a vectored transfer
+  i32   dbn;                  // block to read or write
+  void* buf;                  // BYTESPERBLOCK bytes of memory
+} BioVec;
+
+typedef struct {              // Block cache counters
+  i64 hits;                   // bioRead/bioWrite found the block cached
+  i64 misses;                 // bioRead/bioWrite had to claim a buffer
+  i64 reads;                  // physical block reads from BFSDISK
+  i64 writes;                 // physical block writes to BFSDISK
+  i64 ios;                    // read/write system calls issued
+  i64 prefetched;             // blocks loaded into the cache by bioPrefetch
+  i64 punched;                // zero or freed blocks punched out of BFSDISK
+} BioStats;
+
+i32 bioClose       ();
+i32 bioCreate      ();
+i32 bioDiscard     (i32 dbn, i32 count);
+i32 bioGetStats    (BioStats* stats);
+i32 bioIsZero      (void* buf);
+i32 bioOpen        ();
+i32 bioPrefetch    (i32* dbns, i32 count);
+i32 bioRead        (i32 dbn, void* buf);
+i32 bioReadv       (BioVec* vec, i32 count);
+i32 bioResetStats  ();
+i32 bioSetCacheSize(i32 numBlocks);
+i32 bioSetDisk     (str fname);
+i32 bioSync        ();
+i32 bioWrite       (i32 dbn, void* buf);
+i32 bioWritev      (BioVec* vec, i32 count);
+
+#endif
@@ -9,7 +9,7 @@
 // Dump block DBN
 // ============================================================================
 i32 debDumpDbn(i32 dbn, i32 size) {
-  i8 buf[BYTESPERBLOCK] = {0};
+  i8 buf[BYTESPERBLOCK];
 
   i8*  buf8  = (i8*) buf;
   i16* buf16 = (i16*)buf;
@@ -53,13 +53,13 @@ i32 debDumpDbn(i32 dbn, i32 size) {
 // Dump the Dir
 // ============================================================================
 i32 debDumpDir() {
-  i8 buf[BYTESPERBLOCK] = {0};
-  bioRead(DBNDIR, buf);
-  Dir* dir = (Dir*)buf;
+  i8 buf[BYTESPERBLOCK];
+  DirEnt* dir = (DirEnt*)buf;
 
   printf("\n");
   for (int inum = 0; inum < NUMINODES; ++inum) {
-    printf("[%02d]  %s \n", inum, dir->fname[inum]);
+    if (inum % DIRENTSPERBLOCK == 0) bioRead(bfsDirDbn(inum), buf);
+    printf("[%02d]  %s \n", inum, dir[inum % DIRENTSPERBLOCK].fname);
   }
   printf("\n"); fflush(stdout);
 
@@ -69,22 +69,28 @@ i32 debDumpDir() {
 
 
 // ============================================================================
-// Dump the Inodes
+// Dump the Inodes, as currently held in memory
 // ============================================================================
 i32 debDumpInodes() {
-  i8 buf[BYTESPERBLOCK] = {0};
-  bioRead(DBNINODES, buf);
-
-  Inode* inodes = (Inode*) buf;
-
   printf("\n");
   for (int inum = 0; inum < NUMINODES; ++inum) {
-    Inode inode = inodes[inum];
-    printf("[%d] size = %d \n", inum, inode.size);
+    Inode inode;
+    bfsReadInode(inum, &inode);
+    printf("[%d] size = %lld \n", inum, (long long)inode.size);
+    if (inode.flags & INODEEXTENTS) {
+      for (i32 e = 0; e < NUMEXTENTS; ++e) {
+        printf("    [%d] extent[%d] = fbn %d, dbn %d, len %d \n", inum, e,
+               inode.extent[e].fbn, inode.extent[e].dbn, inode.extent[e].len);
+      }
+      printf("        extentBlock = %d \n", inode.extentBlock);
+      continue;
+    }
     for (i32 d = 0; d < NUMDIRECT; ++d) {
       printf("    [%d] direct[%d] = %d \n", inum, d, inode.direct[d]);
     }
     printf("        indirect  = %d \n", inode.indirect);
+    printf("        dindirect = %d \n", inode.dindirect);
+    printf("        tindirect = %d \n", inode.tindirect);
   }
   printf("\n"); fflush(stdout);
 
@@ -96,21 +102,52 @@ i32 debDumpInodes() {
 // Dump the Superblock
 // ============================================================================
 i32 debDumpSuper() {
-  i8 buf[BYTESPERBLOCK] = {0};
+  i8 buf[BYTESPERBLOCK];
 
   bioRead(DBNSUPER, buf);
 
-  Super* super = (Super*)buf;
+  // A revision 1 SuperBlock keeps a non-zero numBlocks in its first i16
+
+  Super1* old = (Super1*)buf;
+  Super sb;
+  i32 sbSize = sizeof(Super);
+  if (old->numBlocks != 0) {
+    memset(&sb, 0, sizeof(Super));
+    sb.revision      = 1;
+    sb.numBlocks     = old->numBlocks;
+    sb.numInodes     = old->numInodes;
+    sb.firstFree     = old->firstFree;
+    sb.dbnBitmap     = old->dbnBitmap;
+    sb.numBitmap     = old->numBitmap;
+    sb.bytesPerBlock = old->bytesPerBlock;
+    sb.dbnInodes     = old->dbnInodes;
+    sb.dbnDir        = old->dbnDir;
+    sbSize = sizeof(Super1);
+  } else {
+    memcpy(&sb, buf, sizeof(Super));
+  }
+  Super* super = &sb;
 
   printf("\n");
+  printf("Super.revision  = %d \n", super->revision);
   printf("Super.numBlocks = %d \n", super->numBlocks);
   printf("Super.numInodes = %d \n", super->numInodes);
   printf("Super.firstFree = %d \n", super->firstFree);
+  printf("Super.dbnBitmap = %d \n", super->dbnBitmap);
+  printf("Super.numBitmap = %d \n", super->numBitmap);
+  printf("Super.bytesPerBlock = %d \n", super->bytesPerBlock);
+  printf("Super.dbnInodes = %d \n", super->dbnInodes);
+  printf("Super.dbnDir = %d \n", super->dbnDir);
+  printf("Super.flags = %d \n", super->flags);
+  printf("Super.numChunks = %d \n", super->numChunks);
+  for (i32 k = 0; k < super->numChunks; ++k) {
+    printf("Super.dbnChunk[%d] = %d \n", k, super->dbnChunk[k]);
+  }
   printf("\n"); fflush(stdout);
 
   // Check that remainder of Superblock is all zeroes
 
-  for (i32 b = sizeof(Super); b < BYTESPERBLOCK; ++b) {
+  for (i32 b = sbSize; b < BYTESPERBLOCK; ++b) {
     if (buf[b] != 0) {
       printf("Super[%d] == %02x, should be 0x00 \n", b, buf[b]);
     }
@@ -119,4 +156,3 @@ i32 debDumpSuper() {
 
   return 0;
 }
-
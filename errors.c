@@ -6,7 +6,7 @@
 #include <stdlib.h>
 #include "errors.h"
 
-void pause() {
+void pauseExit() {
   printf("\nHit any key to finish ");
   getchar();
   exit(0);
@@ -17,56 +17,69 @@ void pause() {
 void RepTest(int err, str file, int line) {
   RepError(err);
   printf(" in file %s at line %d \n", file, line);
-  pause();
+  pauseExit();
 }
 
 
 void RepError(i32 e) {
   switch(e) {
     case EBADDBN:
-      printf("\nERROR: Bad DBN: negative or too large \n");    pause(); break;
+      printf("\nERROR: Bad DBN: negative or too large \n");    pauseExit(); break;
     case EBADFBN:
-      printf("\nERROR: Bad FBN: negative or too large \n");    pause(); break;
+      printf("\nERROR: Bad FBN: negative or too large \n");    pauseExit(); break;
     case EBADINUM:
-      printf("\nERROR: Bad Inum: negative or too large \n");   pause(); break;
+      printf("\nERROR: Bad Inum: negative or too large \n");   pauseExit(); break;
     case EBADCURS:
-      printf("\nERROR: Bad cursor within file \n");           pause(); break;
+      printf("\nERROR: Bad cursor within file \n");           pauseExit(); break;
     case EBADREAD:
-      printf("\nERROR: Error writing to BFS disk \n");         pause(); break;
+      printf("\nERROR: Error writing to BFS disk \n");         pauseExit(); break;
     case EBADWRITE:
-      printf("\nERROR: Error writing to BFS disk \n");         pause(); break;
+      printf("\nERROR: Error writing to BFS disk \n");         pauseExit(); break;
     case EBIGFNAME:
-      printf("\nERROR: Filename too big \n");                  pause(); break;
+      printf("\nERROR: Filename too big \n");                  pauseExit(); break;
     case EBIGNUMB:
-      printf("\nERROR: Read or write is too big \n");          pause(); break;
+      printf("\nERROR: Read or write is too big \n");          pauseExit(); break;
     case EDIRFULL:
-      printf("\nERROR: Directory is already full \n");         pause(); break;
+      printf("\nERROR: Directory is already full \n");         pauseExit(); break;
     case EDISKCREATE:
-      printf("\nERROR: Failure creating BFS disk \n");         pause(); break;
+      printf("\nERROR: Failure creating BFS disk \n");         pauseExit(); break;
     case EDISKFULL:
-      printf("\nERROR: Disk is full \n");                      pause(); break;
+      printf("\nERROR: Disk is full \n");                      pauseExit(); break;
     case EEXISTS:
-      printf("\nERROR: Format would destroy current disk \n"); pause(); break;
+      printf("\nERROR: Format would destroy current disk \n"); pauseExit(); break;
     case EFNF:
-      printf("\nERROR: File Not Found \n");                    pause(); break;
+      printf("\nERROR: File Not Found \n");                    pauseExit(); break;
     case ENEGNUMB:
-      printf("\nERROR: Negative # bytes in read or write \n"); pause(); break;
+      printf("\nERROR: Negative # bytes in read or write \n"); pauseExit(); break;
     case ENODBN:
-      printf("\nERROR: No DBN yet allocated - non-fatal \n");  pause(); break;
+      printf("\nERROR: No DBN yet allocated - non-fatal \n");  pauseExit(); break;
     case ENODISK:
-      printf("\nERROR: Cannot open the BFS disk \n");          pause(); break;
+      printf("\nERROR: Cannot open the BFS disk \n");          pauseExit(); break;
     case ENOMEM:
-      printf("\nERROR: Failure to malloc memory \n");          pause(); break;
+      printf("\nERROR: Failure to malloc memory \n");          pauseExit(); break;
     case ENULLPTR:
-      printf("\nERROR: About to deref a null pointer \n");     pause(); break;
+      printf("\nERROR: About to deref a null pointer \n");     pauseExit(); break;
     case ENYI:
-      printf("\nERROR: Function Note Yet Implemented \n");     pause(); break;
+      printf("\nERROR: Function Note Yet Implemented \n");     pauseExit(); break;
     case EOFTFULL:
-      printf("\nERROR: OpenFileTable is full \n");             pause(); break;
+      printf("\nERROR: OpenFileTable is full \n");             pauseExit(); break;
     case EBADWHENCE:
-      printf("\nERROR: Invalid 'whence' in fsSeek \n");        pause(); break;
+      printf("\nERROR: Invalid 'whence' in fsSeek \n");        pauseExit(); break;
+    case EBADGEOM:
+      printf("\nERROR: Invalid disk geometry \n");             pauseExit(); break;
+    case ENOTDIR:
+      printf("\nERROR: Path goes through a file \n");          pauseExit(); break;
+    case EISDIR:
+      printf("\nERROR: File is a directory \n");               pauseExit(); break;
+    case EFEXISTS:
+      printf("\nERROR: File already exists \n");               pauseExit(); break;
+    case EBADFD:
+      printf("\nERROR: File Descriptor is not open \n");       pauseExit(); break;
+    case ENOTEMPTY:
+      printf("\nERROR: Directory is not empty \n");           pauseExit(); break;
+    case EFILEOPEN:
+      printf("\nERROR: File is open \n");                      pauseExit(); break;
     default:
-      printf("\nERROR: Miscellaneous error \n");               pause(); break;
+      printf("\nERROR: Miscellaneous error \n");               pauseExit(); break;
   }
 }
-
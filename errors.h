@@ -29,8 +29,15 @@ void RepTest(int err, str file, int line);
 #define ENULLPTR    -19   // about to deref a NULL pointer
 #define ENYI        -20   // not yet implemented
 #define EOFTFULL    -21   // OpenFileTable is full
+#define EBADGEOM    -22   // invalid disk geometry in fsFormat, or in Super
+#define ENOTDIR     -23   // a directory on the path is a file
+#define EISDIR      -24   // fsOpen of a directory
+#define EFEXISTS    -25   // fsMkdir of a name that already exists
+#define EBADFD      -26   // File Descriptor not open
+#define ENOTEMPTY   -27   // fsDelete of a directory that holds files
+#define EFILEOPEN   -28   // fsDelete of a file that is open
 
-void pause();
+void pauseExit();
 void RepError(i32 ret);
 
 #endif
\ No newline at end of file
@@ -1,96 +1,226 @@
 // ============================================================================
 // fs.c - user FileSytem API
+//
+// Every call may be made from any thread.  Reads, writes and other uses of
+// an open file hold the file-system lock shared, plus the file's own lock:
+// shared to read, exclusive to write.  So reads of any files, and writes of
+// different files, run in parallel.  The other calls hold the file-system
+// lock exclusively.  A File Descriptor's cursor belongs to one thread at a
+// time; threads sharing a File Descriptor use fsPread and fsPwrite
 // ============================================================================
 
 #include "bfs.h"
 #include "fs.h"
 
+static i64 fsReadAt(i32 fd, i64 cursor, i64 numb, void *buf);
+static i32 fsWriteAt(i32 fd, i64 cursor, i64 numb, void *buf);
+
 // ============================================================================
-// Close the file currently open on file descriptor 'fd'.
+// Close the file currently open on file descriptor 'fd'.  Other descriptors
+// open on the same file are unaffected
 // ============================================================================
 i32 fsClose(i32 fd)
 {
-    i32 inum = bfsFdToInum(fd);
-    bfsDerefOFT(inum);
-    return 0;
+    bfsLock(0);
+    i32 ret = bfsCloseFd(fd);
+    bfsUnlock();
+    return ret;
 }
 
 // ============================================================================
-// Create the file called 'fname'.  Overwrite, if it already exsists.
-// On success, return its file descriptor.  On failure, EFNF
+// Create the file called 'fname'.  Overwrite, if it already exsists.  'fname'
+// may be a path, such as "a/b/c", through directories made by fsMkdir.  On
+// success, return its file descriptor.  On failure, EFNF, or ENOTDIR if the
+// path goes through a file
 // ============================================================================
 i32 fsCreate(str fname)
 {
+    bfsLock(1);
     i32 inum = bfsCreateFile(fname);
-    if (inum == EFNF)
-        return EFNF;
-    return bfsInumToFd(inum);
+    i32 fd = (inum < 0) ? inum : bfsOpenFd(inum);
+    bfsUnlock();
+    return fd;
+}
+
+// ============================================================================
+// Delete the file called 'fname', which may be a path, such as "a/b/c", or
+// an empty directory made by fsMkdir.  Its blocks return to the free space,
+// and its inum to be reused.  On success, return 0.  If 'fname' does not
+// exist, return EFNF; if it is open, EFILEOPEN; if it is a directory that
+// holds files, ENOTEMPTY
+// ============================================================================
+i32 fsDelete(str fname)
+{
+    bfsLock(1);
+    i32 ret = bfsDeleteFile(fname);
+    bfsUnlock();
+    return ret;
+}
+
+// ============================================================================
+// Reserve disk space for the 'len' bytes from byte-offset 'offset' of the
+// file open on File Descriptor 'fd', so that later writes there find their
+// blocks already allocated, in one contiguous run where free space allows,
+// and coalesce into large I/Os.  The file grows to cover the range; the
+// blocks read as zeros until written.  The cursor is not moved.  On success,
+// return 0.  On failure, abort
+// ============================================================================
+i32 fsFallocate(i32 fd, i64 offset, i64 len)
+{
+    if (offset < 0)
+        FATAL(EBADCURS);
+    if (len < 0)
+        FATAL(ENEGNUMB);
+    if (len == 0)
+        return 0;
+
+    bfsLock(0);
+    bfsLockFile(fd, 1);
+    i32 inum = bfsFdToInum(fd);
+    i64 end = offset + len;
+    if ((end - 1) / BYTESPERBLOCK >= MAXFBN)
+        FATAL(EBIGNUMB);
+
+    bfsDelayFlush(inum); // held blocks get theirs first
+    bfsPrealloc(inum, offset / BYTESPERBLOCK, (end - 1) / BYTESPERBLOCK);
+    if (end > bfsGetSize(inum))
+        bfsSetSize(inum, end);
+
+    bfsUnlockFile(fd);
+    bfsUnlock();
+    return 0;
 }
 
 // ============================================================================
 // Format the BFS disk by initializing the SuperBlock, Inodes, Directory and
-// Freelist.  On succes, return 0.  On failure, abort
+// free-space bitmap.  'geo' gives the block size, disk size and number of
+// Inodes, which are recorded in the SuperBlock, and whether files map their
+// blocks with extents.  NULL => the original BFS disk of 100 blocks of 512
+// bytes, with 8 Inodes.  On succes, return 0.  On failure, abort
 // ============================================================================
-i32 fsFormat()
+i32 fsFormat(FsGeometry *geo)
 {
-    FILE *fp = fopen(BFSDISK, "w+b");
-    if (fp == NULL)
-        FATAL(EDISKCREATE);
+    FsGeometry def = {DEFBYTESPERBLOCK, DEFBLOCKSPERDISK, DEFNUMINODES, 0};
+    if (geo == NULL)
+        geo = &def;
+
+    bfsLock(1);
+    bfsInitGeometry(geo->bytesPerBlock, geo->numBlocks, geo->numInodes,
+                    geo->extents);
 
-    i32 ret = bfsInitSuper(fp); // initialize Super block
+    bioCreate(); // create BFSDISK, and keep it open while we initialize
+
+    i32 ret = bfsInitSuper(); // initialize Super block
     if (ret != 0)
     {
-        fclose(fp);
+        bioClose();
         FATAL(ret);
     }
 
-    ret = bfsInitInodes(fp); // initialize Inodes block
+    ret = bfsInitInodes(); // initialize Inodes block
     if (ret != 0)
     {
-        fclose(fp);
+        bioClose();
         FATAL(ret);
     }
 
-    ret = bfsInitDir(fp); // initialize Dir block
+    ret = bfsInitDir(); // initialize Dir block
     if (ret != 0)
     {
-        fclose(fp);
+        bioClose();
         FATAL(ret);
     }
 
-    ret = bfsInitFreeList(); // initialize Freelist
+    ret = bfsInitFreeList(); // initialize free-space bitmap
     if (ret != 0)
     {
-        fclose(fp);
+        bioClose();
         FATAL(ret);
     }
 
-    fclose(fp);
+    bioClose();
+    bfsUnlock();
     return 0;
 }
 
 // ============================================================================
-// Mount the BFS disk.  It must already exist
+// Make the directory 'path', such as "a/b".  Its parent must already exist.
+// On success, return 0.  On failure, return EFNF if the parent does not
+// exist, ENOTDIR if it is a file, EFEXISTS if 'path' already exists, or ENYI
+// if the disk is revision 1 (such as BFSDISK.PRE), which has no
+// subdirectories
+// ============================================================================
+i32 fsMkdir(str path)
+{
+    bfsLock(1);
+    i32 inum = bfsMakeDir(path);
+    bfsUnlock();
+    return (inum < 0) ? inum : 0;
+}
+
+// ============================================================================
+// Mount the BFS disk.  It must already exist.  BFSDISK stays open until
+// fsUnmount, so block IO does not reopen it for every block, and the Inodes
+// stay resident in memory
 // ============================================================================
 i32 fsMount()
 {
-    FILE *fp = fopen(BFSDISK, "rb");
-    if (fp == NULL)
-        FATAL(ENODISK); // BFSDISK not found
-    fclose(fp);
+    bfsLock(1);
+    bfsMount(); // sets BYTESPERBLOCK from the SuperBlock
+    bfsUnlock();
     return 0;
 }
 
 // ============================================================================
-// Open the existing file called 'fname'.  On success, return its file
-// descriptor.  On failure, return EFNF
+// Open the existing file called 'fname', which may be a path, such as
+// "a/b/c".  On success, return a new file descriptor, with its own cursor at
+// 0: a file may be open on many at once.  On failure, return EFNF, or EISDIR
+// if 'fname' is a directory
 // ============================================================================
 i32 fsOpen(str fname)
 {
+    bfsLock(1);
     i32 inum = bfsLookupFile(fname); // lookup 'fname' in Directory
-    if (inum == EFNF)
-        return EFNF;
-    return bfsInumToFd(inum);
+    i32 fd = (inum < 0) ? inum : bfsOpenFd(inum);
+    bfsUnlock();
+    return fd;
+}
+
+// ============================================================================
+// Read 'numb' bytes of data from byte-offset 'offset' of the file open on File
+// Descriptor 'fd' into 'buf'.  The cursor is neither used nor moved, so many
+// readers may share one File Descriptor.  On success, return actual number of
+// bytes read (may be less than 'numb' if we hit EOF).  On failure, abort
+// ============================================================================
+i64 fsPread(i32 fd, i64 offset, i64 numb, void *buf)
+{
+    if (offset < 0)
+        FATAL(EBADCURS);
+
+    bfsLock(0);
+    bfsLockFile(fd, 0);
+    numb = fsReadAt(fd, offset, numb, buf);
+    bfsUnlockFile(fd);
+    bfsUnlock();
+    return numb;
+}
+
+// ============================================================================
+// Write 'numb' bytes of data from 'buf' at byte-offset 'offset' of the file
+// open on File Descriptor 'fd'.  The cursor is neither used nor moved.  On
+// success, return 0.  On failure, abort
+// ============================================================================
+i32 fsPwrite(i32 fd, i64 offset, i64 numb, void *buf)
+{
+    if (offset < 0)
+        FATAL(EBADCURS);
+
+    bfsLock(0);
+    bfsLockFile(fd, 1);
+    fsWriteAt(fd, offset, numb, buf);
+    bfsUnlockFile(fd);
+    bfsUnlock();
+    return 0;
 }
 
 // ============================================================================
@@ -100,136 +230,112 @@ i32 fsOpen(str fname)
 // ============================================================================
 i32 fsRead(i32 fd, i32 numb, void *buf)
 {
+    return (i32)fsRead64(fd, numb, buf);
+}
+
+// ============================================================================
+// As fsRead, but for 64-bit counts, so a single read may exceed 2 GiB
+// ============================================================================
+i64 fsRead64(i32 fd, i64 numb, void *buf)
+{
+    bfsLock(0);
+    bfsLockFile(fd, 0);
+    i64 cursor = bfsTell(fd);
+    numb = fsReadAt(fd, cursor, numb, buf);
+    bfsSetCursor(fd, cursor + numb);
+    bfsUnlockFile(fd);
+    bfsUnlock();
+    return numb;
+}
+
+// ============================================================================
+// Read 'numb' bytes from byte-offset 'cursor' of the file open on 'fd', for
+// fsRead64 and fsPread, which handle the cursor and the locks themselves
+//
+// The byte range comes from 'cursor' and the file size alone.  Blocks that
+// are wholly inside the range are read straight into 'buf', in batches that
+// bioReadv coalesces into large reads; only a partial first or last block
+// goes through a bounce buffer.  An FBN with no block is read by bfsRead,
+// from the blocks held for delayed allocation, or as zeros for a hole,
+// without touching the disk.  Sequential reads also trigger readahead into
+// the block cache
+// ============================================================================
+static i64 fsReadAt(i32 fd, i64 cursor, i64 numb, void *buf)
+{
+    if (numb < 0)
+        FATAL(ENEGNUMB);
+    if (buf == NULL)
+        FATAL(ENULLPTR);
+
     i32 inum = bfsFdToInum(fd);
-    i32 cursor = bfsTell(fd);
-    i32 curs_start = cursor;
-    i32 size = bfsGetSize(inum);
-    Inode node = {.size = 0, .direct = {[2] = 0}, .indirect = 0};
-    Inode *inode = &node;
-    i32 eof = 0;
-    i32 sum = 0;
-    i8 done = 0;
-    i32 read = 0;
-    i32 block_count = 0;
-    i8 bioBuf[BYTESPERBLOCK];
-    bfsRefOFT(inum);
-    bfsReadInode(inum, inode);
-
-    i32 i = 0;
-    for (i = cursor / BYTESPERBLOCK; i < NUMDIRECT; i++)
+    i64 size = bfsGetSize(inum);
+
+    if (cursor >= size)
+        return 0; // at, or beyond, EOF
+    if (numb > size - cursor)
+        numb = size - cursor; // stop at EOF
+
+    i8 bioBuf[BYTESPERBLOCK]; // bounce buffer for partial blocks
+    BioVec vec[BIOVECBATCH];  // whole blocks, gathered for bioReadv
+    i32 numVec = 0;
+    i8 *dst = buf;
+    i64 pos = cursor;
+    i64 end = cursor + numb;
+
+    bfsReadahead(fd, cursor, end);
+
+    while (pos < end)
     {
-        if (cursor > BYTESPERBLOCK * NUMDIRECT) // if blocks in indirect break
-        {
-            break;
-        }
-        bfsRead(inum, i, (i8 *)bioBuf);
-        if (bioBuf[0] == 0) // if buffer starts at 0 keep reading 0s
-        {
-            read = 1;
-        }
-        for (i32 l = 0; l < BYTESPERBLOCK; l++)
-        {
-            if (read == 0 && bioBuf[l] == 0) // if read 0 stop
-            {
-                eof = l;
-                sum += l;
-                done = 1;
-                break;
-            }
-            else if (read == 1 && bioBuf[l] != 0) // if read 0 stop
+        i32 fbn = pos / BYTESPERBLOCK;
+        i32 off = pos % BYTESPERBLOCK;
+        i32 len = BYTESPERBLOCK - off;
+        if (len > end - pos)
+            len = end - pos;
+
+        if (len == BYTESPERBLOCK)
+        { // whole block: no bounce
+            i32 dbn = bfsFbnToDbn(inum, fbn);
+            if (dbn == ENODBN)
             {
-                read = 0;
+                bfsRead(inum, fbn, dst); // held for delayed allocation, or a hole
+                dst += len;
+                pos += len;
+                continue;
             }
-            if (bioBuf[l] == -1 || sum + l == numb) // if eof stop
+            vec[numVec].dbn = dbn;
+            vec[numVec].buf = dst;
+            if (++numVec == BIOVECBATCH)
             {
-                eof = l;
-                sum += l;
-                done = 1;
-                break;
+                bioReadv(vec, numVec);
+                numVec = 0;
             }
         }
-        if (eof == 0)
+        else
         {
-            if (cursor + BYTESPERBLOCK > size) // if read too far stop
-            {
-                eof = size - cursor;
-                sum += eof;
-                done = 1;
-            }
-            else // increment sum
-            {
-                eof = BYTESPERBLOCK;
-                sum += BYTESPERBLOCK;
-            }
+            bfsRead(inum, fbn, bioBuf);
+            memcpy(dst, bioBuf + off, len);
         }
-        bfsSetCursor(inum, cursor + eof);
-        memmove((buf + block_count * BYTESPERBLOCK), (void *)bioBuf, eof);
-        block_count++;
-        cursor = bfsTell(fd);
-        eof = 0;
-        if (sum == numb || done == 1)
-            break;
+        dst += len;
+        pos += len;
     }
-    // follows similar logic above so no duplicate comments
-    i = 0;
-    if (cursor < size && done != 1)
-    {
-        eof = 0;
-        while (cursor < size && done != 1)
-        {
-            i32 fbn = cursor / BYTESPERBLOCK; // get indirect block
-            bfsRead(inum, fbn, (i8 *)bioBuf);
-            if (bioBuf[0] == 0)
-            {
-                read = 1;
-            }
-            for (i32 l = 0; l < BYTESPERBLOCK; l++)
-            {
-                if (read == 0 && bioBuf[l] == 0)
-                {
-                    eof = l;
-                    sum += l;
-                    done = 1;
-                    break;
-                }
-                else if (read == 1 && bioBuf[l] != 0) // if read 0 stop
-                {
-                    read = 0;
-                }
-                if (bioBuf[l] == -1 || sum + l == numb)
-                {
-                    eof = l;
-                    sum += l;
-                    done = 1;
-                    break;
-                }
-            }
-            if (eof == 0)
-            {
-                if (cursor + BYTESPERBLOCK > size)
-                {
-                    eof = size - cursor;
-                    sum += eof;
-                    done = 1;
-                }
-                else
-                {
-                    eof = BYTESPERBLOCK;
-                    sum += BYTESPERBLOCK;
-                }
-            }
-            bfsSetCursor(inum, cursor + eof);
-            memmove((buf + block_count * BYTESPERBLOCK), (void *)bioBuf, eof);
-            block_count++;
-            eof = 0;
-            cursor = bfsTell(fd);
-            if (sum == numb || done == 1)
-                break;
-            fbn++;
-        }
-    }
-    bfsDerefOFT(inum);
-    return sum;
+    if (numVec > 0)
+        bioReadv(vec, numVec);
+    return numb;
+}
+
+// ============================================================================
+// List the directory 'path', one name per call: copy the name of the next
+// entry into 'fname', which must hold FNAMESIZE chars.  "" or "/" lists the
+// top-level Directory.  Set '*pos' to 0 before the first call; each call
+// moves it on.  On success, return 0.  When no entries remain, or 'path' does
+// not exist, return EFNF.  If 'path' is a file, return ENOTDIR
+// ============================================================================
+i32 fsReaddir(str path, i32 *pos, str fname)
+{
+    bfsLock(1);
+    i32 ret = bfsReadDir(path, pos, fname);
+    bfsUnlock();
+    return ret;
 }
 
 // ============================================================================
@@ -243,26 +349,31 @@ i32 fsRead(i32 fd, i32 numb, void *buf)
 // On success, return 0.  On failure, abort
 // ============================================================================
 i32 fsSeek(i32 fd, i32 offset, i32 whence)
+{
+    return fsSeek64(fd, offset, whence);
+}
+
+// ============================================================================
+// As fsSeek, but for 64-bit offsets
+// ============================================================================
+i32 fsSeek64(i32 fd, i64 offset, i32 whence)
 {
 
     if (offset < 0)
         FATAL(EBADCURS);
 
-    i32 inum = bfsFdToInum(fd);
-    i32 ofte = bfsFindOFTE(inum);
-
     switch (whence)
     {
     case SEEK_SET:
-        g_oft[ofte].curs = offset;
+        bfsSetCursor(fd, offset);
         break;
     case SEEK_CUR:
-        g_oft[ofte].curs += offset;
+        bfsSetCursor(fd, bfsTell(fd) + offset);
         break;
     case SEEK_END:
     {
-        i32 end = fsSize(fd);
-        g_oft[ofte].curs = end + offset;
+        i64 end = fsSize64(fd); // takes the file's lock
+        bfsSetCursor(fd, end + offset);
         break;
     }
     default:
@@ -271,10 +382,42 @@ i32 fsSeek(i32 fd, i32 offset, i32 whence)
     return 0;
 }
 
+// ============================================================================
+// Keep the BFS disk in host file 'fname', rather than BFSDISK, from the next
+// fsFormat or fsMount on.  On success, return 0.  On failure, abort
+// ============================================================================
+i32 fsSetDisk(str fname)
+{
+    return bioSetDisk(fname);
+}
+
+// ============================================================================
+// Write all modified Inodes and cached blocks back to the BFS disk.  On
+// success, return 0.  On failure, abort
+// ============================================================================
+i32 fsSync()
+{
+    bfsLock(1);
+    i32 ret = bfsSync();
+    bfsUnlock();
+    return ret;
+}
+
 // ============================================================================
 // Return the cursor position for the file open on File Descriptor 'fd'
 // ============================================================================
 i32 fsTell(i32 fd)
+{
+    i64 curs = bfsTell(fd);
+    if (curs > INT32_MAX)
+        FATAL(EBIGNUMB); // use fsTell64
+    return curs;
+}
+
+// ============================================================================
+// As fsTell, but for files of any size
+// ============================================================================
+i64 fsTell64(i32 fd)
 {
     return bfsTell(fd);
 }
@@ -286,8 +429,53 @@ i32 fsTell(i32 fd)
 // ============================================================================
 i32 fsSize(i32 fd)
 {
-    i32 inum = bfsFdToInum(fd);
-    return bfsGetSize(inum);
+    i64 size = fsSize64(fd);
+    if (size > INT32_MAX)
+        FATAL(EBIGNUMB); // use fsSize64
+    return size;
+}
+
+// ============================================================================
+// As fsSize, but for files of any size
+// ============================================================================
+i64 fsSize64(i32 fd)
+{
+    bfsLock(0);
+    bfsLockFile(fd, 0);
+    i64 size = bfsGetSize(bfsFdToInum(fd));
+    bfsUnlockFile(fd);
+    bfsUnlock();
+    return size;
+}
+
+// ============================================================================
+// Set the size of the file open on File Descriptor 'fd' to 'size' bytes.
+// Shrinking it frees every block beyond the new EOF; growing it leaves a
+// hole, which reads as zeros.  The cursor is not moved.  On success, return
+// 0.  On failure, abort
+// ============================================================================
+i32 fsTruncate(i32 fd, i64 size)
+{
+    if (size < 0)
+        FATAL(EBADCURS);
+
+    bfsLock(0);
+    bfsLockFile(fd, 1);
+    bfsTruncate(bfsFdToInum(fd), size);
+    bfsUnlockFile(fd);
+    bfsUnlock();
+    return 0;
+}
+
+// ============================================================================
+// Unmount the BFS disk: write back Inodes and cached blocks, and close BFSDISK
+// ============================================================================
+i32 fsUnmount()
+{
+    bfsLock(1);
+    i32 ret = bfsUnmount();
+    bfsUnlock();
+    return ret;
 }
 
 // ============================================================================
@@ -295,124 +483,105 @@ i32 fsSize(i32 fd)
 // filedescriptor 'fd'.  The write starts at the current file offset for the
 // destination file.  On success, return 0.  On failure, abort
 // ============================================================================
-i32 fsWrite(i32 fd, i32 numb, void *buf) //TODO write inode
+i32 fsWrite(i32 fd, i32 numb, void *buf)
 {
-    i32 inum = bfsFdToInum(fd);
-    i32 cursor = bfsTell(fd);
-    Inode inode;
-    i32 fsize = bfsGetSize(inum);
-    i8 bioBuf[BYTESPERBLOCK];
-    i32 inside = 0;
-    i32 outside = 0;
-    i32 overlap = 0;
-    i32 size = fsize;
+    return fsWrite64(fd, numb, buf);
+}
 
-    bfsRefOFT(inum);
-    bfsReadInode(inum, &inode);
+// ============================================================================
+// As fsWrite, but for 64-bit counts
+// ============================================================================
+i32 fsWrite64(i32 fd, i64 numb, void *buf)
+{
+    bfsLock(0);
+    bfsLockFile(fd, 1);
+    i64 cursor = bfsTell(fd);
+    fsWriteAt(fd, cursor, numb, buf);
+    bfsSetCursor(fd, cursor + numb);
+    bfsUnlockFile(fd);
+    bfsUnlock();
+    return 0;
+}
 
-    i32 write_size = cursor + numb;
+// ============================================================================
+// Write 'numb' bytes to byte-offset 'cursor' of the file open on 'fd', for
+// fsWrite64 and fsPwrite, which handle the cursor and the locks themselves
+//
+// Blocks that are wholly overwritten are written straight from 'buf', in
+// batches that bioWritev coalesces into large writes.  Only a partial first or
+// last block is read, patched and written back, through a bounce buffer.
+//
+// Only the FBNs written are given blocks.  A write beyond EOF leaves a hole
+// between the old EOF and 'cursor', which reads as zeros, so a sparse file
+// costs neither the space nor the writes of the blocks it skips.
+//
+// Allocation is delayed: an FBN with no block yet is held in the file's OFT
+// entry by bfsDelayWrite, and only gets a DBN when bfsDelayFlush writes the
+// held blocks out as contiguous runs - when NUMDELAY have gathered, on the
+// last fsClose, or on fsSync.  Files appended to side by side, a little at a
+// time, are so laid out in long runs rather than interleaved
+// ============================================================================
+static i32 fsWriteAt(i32 fd, i64 cursor, i64 numb, void *buf)
+{
+    if (numb < 0)
+        FATAL(ENEGNUMB);
+    if (buf == NULL)
+        FATAL(ENULLPTR);
+    if (numb == 0)
+        return 0;
 
-    if (write_size < fsize)
-    {
-        inside = 1;
-    }
-    else if (cursor < fsize)
-    {
-        overlap = 1;
-    }
-    else
-    {
-        outside = 1;
-    }
+    i32 inum = bfsFdToInum(fd);
+    i64 size = bfsGetSize(inum);
+    i64 end = cursor + numb;
 
-    //created a buffer
-    i32 buf_rem = write_size % BYTESPERBLOCK;
-    i32 bytes = write_size + buf_rem;
-    i32 blocks = 0;
-    if (numb % BYTESPERBLOCK == 0)
-    {
-        blocks = (numb / BYTESPERBLOCK);
-    }
-    else
-    {
-        blocks = (numb / BYTESPERBLOCK) + 1;
-    }
-    i8 *buffer_p = malloc(bytes);
-    i8 buffer = *buffer_p;
+    if ((end - 1) / BYTESPERBLOCK >= MAXFBN)
+        FATAL(EBIGNUMB);
 
-    i32 curs_block = cursor / BYTESPERBLOCK;
-    i32 start_dbn = 0;
-    i32 final_fbn = (cursor + numb) / BYTESPERBLOCK;
+    i8 bioBuf[BYTESPERBLOCK]; // bounce buffer for partial blocks
+    BioVec vec[BIOVECBATCH];  // whole blocks, gathered for bioWritev
+    i32 numVec = 0;
+    i8 *src = buf;
+    i64 pos = cursor;
 
-    i32 i = 0;
-    if (inside == 1 || overlap == 1)
+    while (pos < end)
     {
-        start_dbn = bfsFbnToDbn(inum, curs_block);
-        bfsRead(inum, curs_block, (i8 *)bioBuf); // read first block
-        i32 curs_remain = cursor % BYTESPERBLOCK;
-        memmove((void *)buffer_p, (void *)bioBuf, curs_remain);
-        memmove((void *)(buffer_p + curs_remain), buf, numb);
+        i32 fbn = pos / BYTESPERBLOCK;
+        i32 off = pos % BYTESPERBLOCK;
+        i32 len = BYTESPERBLOCK - off;
+        if (len > end - pos)
+            len = end - pos;
 
-        if (numb < BYTESPERBLOCK) // if we only read first block
-        {
-            i32 offset = numb + curs_remain;
-            memmove((void *)(buffer_p + offset), (void *)(bioBuf + offset), BYTESPERBLOCK - offset);
-        }
-        else if (inside == 1) // get final block and move leftover data
-        {
-            bfsRead(inum, final_fbn, (i8 *)bioBuf);
-            i32 offset = numb + curs_remain;
-            i32 remainder = offset % BYTESPERBLOCK;
-            memmove(((void *)(buffer_p + offset)), (void *)(bioBuf + remainder), BYTESPERBLOCK - remainder);
-        }
-        else if (overlap == 1)
-        {
-            size = write_size;
-            i32 extendo = fsize + numb;
-            i32 eblocks = (extendo / BYTESPERBLOCK);
-            bfsExtend(inum, eblocks);
+        i32 dbn = bfsFbnToDbn(inum, fbn);
+        if (dbn == ENODBN)
+        { // no block yet: hold the data until the file is flushed
+            bfsDelayWrite(inum, fbn, off, len, src);
         }
-
-        i32 fbn = curs_block;
-        i32 dbn = start_dbn;
-
-        for (i = 0; i < blocks; i++)
-        {
-            if (dbn > BLOCKSPERDISK - 1)
+        else if (len == BYTESPERBLOCK)
+        { // whole block: no read needed
+            vec[numVec].dbn = dbn;
+            vec[numVec].buf = src;
+            if (++numVec == BIOVECBATCH)
             {
-                break;
+                bioWritev(vec, numVec);
+                numVec = 0;
             }
-            bioWrite(dbn, (void *)(buffer_p + (i * BYTESPERBLOCK)));
-            fbn++;
-            dbn = bfsFbnToDbn(inum, fbn);
         }
-        bfsSetCursor(inum, write_size);
-        cursor = write_size;
-    }
-    else if (outside)
-    {
-        memmove((void *)buffer_p, buf, numb);
-        size = fsize + numb;
-        i32 extendo = fsize + numb;
-        i32 eblocks = (extendo / BYTESPERBLOCK);
-        bfsExtend(inum, eblocks);
-
-        i32 fbn = curs_block;
-        i32 dbn = bfsFbnToDbn(inum, fbn);
-        for (i = 0; i < blocks; i++)
+        else
         {
-            if (dbn > BLOCKSPERDISK - 1)
-            {
-                break;
-            }
-            bioWrite(dbn, (void *)(buffer_p + (i * BYTESPERBLOCK)));
-            fbn++;
-            dbn = bfsFbnToDbn(inum, fbn);
+            if ((i64)fbn * BYTESPERBLOCK >= size)
+                memset(bioBuf, 0, BYTESPERBLOCK); // no file data here yet
+            else
+                bioRead(dbn, bioBuf);
+            memcpy(bioBuf + off, src, len);
+            bioWrite(dbn, bioBuf);
         }
-        bfsSetCursor(inum, write_size);
-        cursor = write_size;
+        src += len;
+        pos += len;
     }
-    bfsSetSize(inum, size);
-    bfsDerefOFT(inum);
+    if (numVec > 0)
+        bioWritev(vec, numVec);
+
+    if (end > size)
+        bfsSetSize(inum, end);
     return 0;
 }
@@ -9,15 +9,37 @@
 #include "alias.h"
 #include "errors.h"
 
+typedef struct {       // Geometry of a new BFS disk, for fsFormat
+  i32 bytesPerBlock;   // power of 2, from 512 to 65536.  eg: 4096
+  i32 numBlocks;       // size of the disk, in blocks
+  i32 numInodes;       // # of files, to start with.  eg: 8
+  i32 extents;         // 1 => files map their blocks with extents
+} FsGeometry;
+
 i32 fsClose(i32 fd);
 i32 fsCreate(str name);
-i32 fsFormat();
+i32 fsDelete(str fname);
+i32 fsFallocate(i32 fd, i64 offset, i64 len);
+i32 fsFormat(FsGeometry *geo);
+i32 fsMkdir(str path);
 i32 fsMount();
 i32 fsOpen(str fname);
+i64 fsPread(i32 fd, i64 offset, i64 numb, void *buf);
+i32 fsPwrite(i32 fd, i64 offset, i64 numb, void *buf);
 i32 fsRead(i32 fd, i32 numb, void *buf);
+i64 fsRead64(i32 fd, i64 numb, void *buf);
+i32 fsReaddir(str path, i32 *pos, str fname);
 i32 fsSeek(i32 fd, i32 offset, i32 whence);
+i32 fsSeek64(i32 fd, i64 offset, i32 whence);
+i32 fsSetDisk(str fname);
 i32 fsSize(i32 fd);
+i64 fsSize64(i32 fd);
+i32 fsSync();
 i32 fsTell(i32 fd);
+i64 fsTell64(i32 fd);
+i32 fsTruncate(i32 fd, i64 size);
+i32 fsUnmount();
 i32 fsWrite(i32 fd, i32 numb, void *buf);
+i32 fsWrite64(i32 fd, i64 numb, void *buf);
 
 #endif
\ No newline at end of file
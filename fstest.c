@@ -0,0 +1,907 @@
+// ============================================================================
+// fstest.c : checks, in the style of p5test, of the features that need a BFS
+// disk of their own - larger than BFSDISK.PRE, or with extents.  Each test
+// formats FSTESTDISK, a scratch disk that is removed at the end, so the
+// fixture BFSDISK.PRE is never touched.  The checks go through the fs calls,
+// and bioGetStats where only the block IO tells
+// ============================================================================
+
+#include "bfs.h"
+#include "p5test.h"
+
+#define FSTESTDISK "FSTEST.BFS" // scratch disk, removed at the end
+#define CHUNK      65536        // bytes per fsWrite or fsRead of a file
+
+// ============================================================================
+// Format FSTESTDISK with geometry 'geo', and mount it
+// ============================================================================
+static void freshDisk(FsGeometry geo)
+{
+  fsFormat(&geo);
+  fsMount();
+}
+
+// ============================================================================
+// Unmount the disk, so every block goes to FSTESTDISK, and mount it again
+// ============================================================================
+static void remount()
+{
+  fsUnmount();
+  fsMount();
+}
+
+// ============================================================================
+// Fill 'buf' with the 'numb' bytes that file number 'file' holds from byte
+// 'offset' on.  No byte is 0, so no block of the data is all zeros
+// ============================================================================
+static void fillData(i8 *buf, i32 file, i64 offset, i64 numb)
+{
+  for (i64 i = 0; i < numb; ++i)
+    buf[i] = (i8)(1 + (file * 31 + (offset + i) % 251) % 255);
+}
+
+// ============================================================================
+// Create file 'fname', write the 'numb' bytes of file number 'file' to it,
+// from the start, and close it
+// ============================================================================
+static void writeFile(str fname, i32 file, i64 numb)
+{
+  static i8 buf[CHUNK];
+  i32 fd = fsCreate(fname);
+  for (i64 off = 0; off < numb; off += CHUNK)
+  {
+    i32 n = (numb - off < CHUNK) ? numb - off : CHUNK;
+    fillData(buf, file, off, n);
+    fsWrite(fd, n, buf);
+  }
+  fsClose(fd);
+}
+
+// ============================================================================
+// Return -1 if file 'fname' holds exactly the 'numb' bytes of file number
+// 'file'.  Otherwise, return the offset of the first byte that differs, or
+// its size, if that is wrong
+// ============================================================================
+static i64 diffFile(str fname, i32 file, i64 numb)
+{
+  static i8 buf[CHUNK];
+  static i8 rbuf[CHUNK];
+  i32 fd = fsOpen(fname);
+  i64 size = fsSize64(fd);
+  i64 diff = (size == numb) ? -1 : size;
+  for (i64 off = 0; diff < 0 && off < numb; off += CHUNK)
+  {
+    i32 n = (numb - off < CHUNK) ? numb - off : CHUNK;
+    fillData(buf, file, off, n);
+    fsRead(fd, n, rbuf);
+    for (i32 i = 0; diff < 0 && i < n; ++i)
+    {
+      if (rbuf[i] != buf[i])
+        diff = off + i;
+    }
+  }
+  fsClose(fd);
+  return diff;
+}
+
+// ============================================================================
+// TEST 13 : A revision 2 disk of 70,000 blocks.  Its files fill it beyond
+// DBN 65535, the last a 16-bit DBN could hold, and read back intact after a
+// remount.  The 64-bit calls agree with the 32-bit ones on a small file
+// ============================================================================
+void test13()
+{
+  static i8 buf[1000];
+  char fname[FNAMESIZE];
+  i32 numFiles = 500;
+  i64 numb = 133 * 512; // as large as a file can be, with single indirection
+
+  freshDisk((FsGeometry){512, 70000, 600});
+
+  printf("Fill the disk beyond DBN 65535:\n");
+  for (i32 f = 0; f < numFiles; ++f)
+  {
+    sprintf(fname, "Big%d", f);
+    writeFile(fname, f, numb);
+  }
+  remount();
+  checkNum(13, "first bad byte", -1, diffFile("Big0", 0, numb));
+  checkNum(13, "first bad byte", -1, diffFile("Big250", 250, numb));
+  sprintf(fname, "Big%d", numFiles - 1);
+  checkNum(13, "first bad byte", -1, diffFile(fname, numFiles - 1, numb));
+
+  printf("64-bit calls agree with the 32-bit ones:\n");
+  i32 fd = fsOpen(fname);
+  checkNum(13, "fsSize64", fsSize(fd), fsSize64(fd));
+  fsSeek64(fd, numb - 100, SEEK_SET);
+  checkNum(13, "fsTell64", fsTell(fd), fsTell64(fd));
+  checkNum(13, "fsTell", numb - 100, fsTell(fd));
+  checkNum(13, "fsRead64", 100, fsRead64(fd, sizeof(buf), buf));
+  i8 first;
+  fillData(&first, numFiles - 1, numb - 100, 1);
+  checkNum(13, "byte read", first, buf[0]);
+  fsClose(fd);
+
+  fsUnmount();
+}
+
+// ============================================================================
+// TEST 14 : Double- and triple-indirect tables.  With 512-byte blocks, FBN
+// 133 is the first mapped through the double-indirect table, and FBN 16517 -
+// 5 + 128 + 128 * 128 - the first through the triple-indirect.  Writes that
+// straddle both boundaries read back intact after a remount, and the gap
+// between them reads as zeros
+// ============================================================================
+void test14()
+{
+  static i8 buf[16 * 512];
+  static i8 rbuf[16 * 512];
+
+  freshDisk((FsGeometry){512, 20000, 16});
+
+  printf("Write across the double- and triple-indirect boundaries:\n");
+  i32 fd = fsCreate("Deep");
+  fillData(buf, 1, 0, sizeof(buf));
+  fsSeek64(fd, 130 * 512, SEEK_SET);
+  fsWrite(fd, 8 * 512, buf);
+  fsSeek64(fd, 16510 * 512, SEEK_SET);
+  fsWrite(fd, 16 * 512, buf);
+  fsClose(fd);
+  remount();
+
+  fd = fsOpen("Deep");
+  checkNum(14, "size", 16526 * 512, fsSize64(fd));
+  fsSeek64(fd, 130 * 512, SEEK_SET);
+  fsRead(fd, 8 * 512, rbuf);
+  checkStr(14, rbuf, 0, 8 * 512, (char *)buf);
+  fsSeek64(fd, 16510 * 512, SEEK_SET);
+  fsRead(fd, 16 * 512, rbuf);
+  checkStr(14, rbuf, 0, 16 * 512, (char *)buf);
+
+  printf("The gap reads as zeros:\n");
+  fsSeek64(fd, 16500 * 512, SEEK_SET);
+  fsRead(fd, 10 * 512, rbuf);
+  check(14, rbuf, 0, 10 * 512, 0);
+  fsSeek64(fd, 138 * 512, SEEK_SET);
+  fsRead(fd, 10 * 512, rbuf);
+  check(14, rbuf, 0, 10 * 512, 0);
+  fsClose(fd);
+
+  fsUnmount();
+}
+
+// ============================================================================
+// Return the # of Extents that the Inode of file 'fname' holds, or -1 if
+// they have moved to an extent tree
+// ============================================================================
+static i32 numExtents(str fname)
+{
+  Inode inode;
+  i32 fd = fsOpen(fname);
+  bfsReadInode(bfsFdToInum(fd), &inode);
+  fsClose(fd);
+
+  if (inode.extentBlock != 0)
+    return -1;
+  i32 count = 0;
+  while (count < NUMEXTENTS && inode.extent[count].len > 0)
+    ++count;
+  return count;
+}
+
+// ============================================================================
+// Write 'numBlocks' blocks to each of the files open on 'fd1' and 'fd2' -
+// the data of file numbers 'file1' and 'file2' - a block to each in turn.
+// fsSync after every block gives it a DBN there and then, so the two files
+// take turns at the free blocks
+// ============================================================================
+static void writeTurns(i32 fd1, i32 file1, i32 fd2, i32 file2, i32 numBlocks)
+{
+  i8 buf[512];
+  for (i32 fbn = 0; fbn < numBlocks; ++fbn)
+  {
+    fillData(buf, file1, fbn * 512, 512);
+    fsWrite(fd1, 512, buf);
+    fsSync();
+    fillData(buf, file2, fbn * 512, 512);
+    fsWrite(fd2, 512, buf);
+    fsSync();
+  }
+}
+
+// ============================================================================
+// TEST 15 : Extents.  A file written sequentially grows one Extent.  Two
+// files written in turns take a block each in turn, so each needs an Extent
+// per block: more than a leaf of the extent tree holds, so the leaf splits.
+// Both read back intact after a remount
+// ============================================================================
+void test15()
+{
+  freshDisk((FsGeometry){512, 4000, 16, 1});
+
+  printf("A file written sequentially keeps one Extent:\n");
+  writeFile("Seq", 1, 200 * 512 + 100);
+  checkNum(15, "extents", 1, numExtents("Seq"));
+
+  printf("Files written in turns split the extent tree:\n");
+  i32 fdA = fsCreate("Turns1");
+  i32 fdB = fsCreate("Turns2");
+  writeTurns(fdA, 2, fdB, 3, 2 * EXTENTSPERNODE + 10);
+  fsClose(fdA);
+  fsClose(fdB);
+  checkNum(15, "extents", -1, numExtents("Turns1"));
+
+  remount();
+  i64 numb = (2 * EXTENTSPERNODE + 10) * 512;
+  checkNum(15, "first bad byte", -1, diffFile("Seq", 1, 200 * 512 + 100));
+  checkNum(15, "first bad byte", -1, diffFile("Turns1", 2, numb));
+  checkNum(15, "first bad byte", -1, diffFile("Turns2", 3, numb));
+
+  fsUnmount();
+}
+
+// ============================================================================
+// Create file 'fname', holding just the i32 'val', and close it
+// ============================================================================
+static void writeVal(str fname, i32 val)
+{
+  i32 fd = fsCreate(fname);
+  fsWrite(fd, sizeof(i32), &val);
+  fsClose(fd);
+}
+
+// ============================================================================
+// Return the i32 that file 'fname' holds, as written by writeVal, or the
+// error fsOpen returns for it
+// ============================================================================
+static i32 readVal(str fname)
+{
+  i32 val = 0;
+  i32 fd = fsOpen(fname);
+  if (fd < 0)
+    return fd;
+  fsRead(fd, sizeof(i32), &val);
+  fsClose(fd);
+  return val;
+}
+
+// ============================================================================
+// TEST 16 : The hashed Dir.  Hundreds of files are found by name after a
+// remount, each holding its own number, and names never created are not
+// ============================================================================
+void test16()
+{
+  char fname[FNAMESIZE];
+  i32 numFiles = 300;
+
+  freshDisk((FsGeometry){512, 2000, 400});
+
+  printf("Hundreds of files are found by name:\n");
+  for (i32 f = 0; f < numFiles; ++f)
+  {
+    sprintf(fname, "Hash%d", f);
+    writeVal(fname, f);
+  }
+  remount();
+  i32 found = 0;
+  for (i32 f = 0; f < numFiles; ++f)
+  {
+    sprintf(fname, "Hash%d", f);
+    found += (readVal(fname) == f);
+  }
+  checkNum(16, "files found", numFiles, found);
+
+  printf("Names never created are not found:\n");
+  sprintf(fname, "Hash%d", numFiles);
+  checkNum(16, "fsOpen", EFNF, fsOpen(fname));
+  checkNum(16, "fsOpen", EFNF, fsOpen("Hash"));
+
+  fsUnmount();
+}
+
+// ============================================================================
+// Copy the fixture BFSDISK to FSTESTDISK, so it can be changed freely
+// ============================================================================
+static void copyFixture()
+{
+  static i8 buf[CHUNK];
+  FILE *from = fopen(BFSDISK, "rb");
+  FILE *to = fopen(FSTESTDISK, "wb");
+  if (from == NULL || to == NULL)
+    FATAL(ENODISK);
+
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), from)) > 0)
+    fwrite(buf, 1, n, to);
+  fclose(from);
+  fclose(to);
+}
+
+// ============================================================================
+// TEST 17 : Subdirectories.  Paths resolve through nested directories, one
+// name may be used in each, fsReaddir lists a directory, and each misuse of
+// a path gets its error.  A revision 1 disk has no subdirectories
+// ============================================================================
+void test17()
+{
+  char fname[FNAMESIZE];
+
+  freshDisk((FsGeometry){512, 2000, 32});
+
+  printf("Make nested directories, and a file in each:\n");
+  checkNum(17, "fsMkdir", 0, fsMkdir("A"));
+  checkNum(17, "fsMkdir", 0, fsMkdir("A/B"));
+  checkNum(17, "fsMkdir", 0, fsMkdir("A/B/C"));
+  writeVal("F", 1);
+  writeVal("A/F", 2);
+  writeVal("A/B/F", 3);
+  writeVal("A/B/C/F", 4);
+  remount();
+  checkNum(17, "F", 1, readVal("F"));
+  checkNum(17, "A/F", 2, readVal("A/F"));
+  checkNum(17, "A/B/F", 3, readVal("A/B/F"));
+  checkNum(17, "A/B/C/F", 4, readVal("A/B/C/F"));
+
+  printf("fsReaddir lists a directory:\n");
+  i32 pos = 0;
+  i32 seen = 0;
+  while (fsReaddir("A/B", &pos, fname) == 0)
+    seen |= (strcmp(fname, "C") == 0) ? 1 : (strcmp(fname, "F") == 0) ? 2 : 4;
+  checkNum(17, "names seen", 3, seen);
+
+  printf("Misuse of a path gets its error:\n");
+  checkNum(17, "fsMkdir", EFEXISTS, fsMkdir("A/B"));
+  checkNum(17, "fsMkdir", EFNF, fsMkdir("X/Y"));
+  checkNum(17, "fsMkdir", ENOTDIR, fsMkdir("A/F/Y"));
+  checkNum(17, "fsCreate", ENOTDIR, fsCreate("F/G"));
+  checkNum(17, "fsOpen", EISDIR, fsOpen("A/B"));
+  checkNum(17, "fsOpen", EFNF, fsOpen("A/B/G"));
+  pos = 0;
+  checkNum(17, "fsReaddir", ENOTDIR, fsReaddir("A/F", &pos, fname));
+  fsUnmount();
+
+  printf("A revision 1 disk has no subdirectories:\n");
+  copyFixture();
+  fsMount();
+  checkNum(17, "fsMkdir", ENYI, fsMkdir("D"));
+  fsUnmount();
+}
+
+// ============================================================================
+// TEST 18 : Growing the Inode table.  A disk formatted for 8 files takes 40,
+// and each is found, holding its own number, after a remount
+// ============================================================================
+void test18()
+{
+  char fname[FNAMESIZE];
+  i32 numFiles = 40;
+
+  freshDisk((FsGeometry){512, 2000, 8});
+
+  printf("Create more files than the disk was formatted for:\n");
+  for (i32 f = 0; f < numFiles; ++f)
+  {
+    sprintf(fname, "Grow%d", f);
+    writeVal(fname, f);
+  }
+  remount();
+  i32 found = 0;
+  for (i32 f = 0; f < numFiles; ++f)
+  {
+    sprintf(fname, "Grow%d", f);
+    found += (readVal(fname) == f);
+  }
+  checkNum(18, "files found", numFiles, found);
+
+  i32 pos = 0;
+  i32 listed = 0;
+  while (fsReaddir("", &pos, fname) == 0)
+    ++listed;
+  checkNum(18, "files listed", numFiles, listed);
+
+  fsUnmount();
+}
+
+// ============================================================================
+// TEST 19 : fsPread and fsPwrite.  They neither use nor move the cursor.  A
+// read is cut short at EOF, and reads nothing beyond it, even 3 GiB beyond.
+// A write beyond EOF grows the file, with zeros in the gap.  Two File
+// Descriptors on one file keep cursors of their own
+// ============================================================================
+void test19()
+{
+  static i8 buf[10 * 512];
+  static i8 rbuf[10 * 512];
+
+  freshDisk((FsGeometry){512, 2000, 16});
+  writeFile("Pos", 5, 10 * 512);
+  fillData(buf, 5, 0, 10 * 512);
+
+  printf("fsPread neither uses nor moves the cursor:\n");
+  i32 fd = fsOpen("Pos");
+  fsSeek(fd, 100, SEEK_SET);
+  checkNum(19, "fsPread", 500, fsPread(fd, 1000, 500, rbuf));
+  checkStr(19, rbuf, 0, 500, (char *)buf + 1000);
+  checkCursor(19, 100, fsTell(fd));
+
+  printf("A read is cut short at EOF:\n");
+  checkNum(19, "fsPread", 100, fsPread(fd, 10 * 512 - 100, 500, rbuf));
+  checkStr(19, rbuf, 0, 100, (char *)buf + 10 * 512 - 100);
+  checkNum(19, "fsPread", 0, fsPread(fd, 10 * 512, 500, rbuf));
+  checkNum(19, "fsPread", 0, fsPread(fd, 3ll << 30, 500, rbuf));
+
+  printf("A write beyond EOF grows the file:\n");
+  fsPwrite(fd, 12 * 512 + 10, 100, buf);
+  checkCursor(19, 100, fsTell(fd));
+  checkNum(19, "size", 12 * 512 + 110, fsSize64(fd));
+  memset(rbuf, 1, sizeof(rbuf));
+  fsPread(fd, 10 * 512, 2 * 512 + 110, rbuf);
+  check(19, rbuf, 0, 2 * 512 + 10, 0);
+  checkStr(19, rbuf + 2 * 512 + 10, 0, 100, (char *)buf);
+
+  printf("Two File Descriptors keep cursors of their own:\n");
+  i32 fd2 = fsOpen("Pos");
+  fsRead(fd2, 300, rbuf);
+  checkCursor(19, 300, fsTell(fd2));
+  checkCursor(19, 100, fsTell(fd));
+  fsRead(fd, 50, rbuf);
+  checkStr(19, rbuf, 0, 50, (char *)buf + 100);
+  checkCursor(19, 300, fsTell(fd2));
+  fsClose(fd2);
+  fsClose(fd);
+
+  fsUnmount();
+}
+
+// ============================================================================
+// TEST 20 : Sparse files.  On a 4 KiB-block disk of just 2,000 blocks, a file
+// written 3 GiB in keeps a hole in front: it takes 2 data blocks, not the
+// 786,000 a zero-filled gap would, and the hole reads as zeros, also beyond
+// 2 GiB, where a 32-bit offset would go negative
+// ============================================================================
+void test20()
+{
+  static i8 buf[4096];
+  static i8 rbuf[4096];
+  i64 far = 3ll << 30;
+
+  freshDisk((FsGeometry){4096, 2000, 16});
+
+  printf("Write 3 GiB into a file:\n");
+  i32 fd = fsCreate("Sparse");
+  fillData(buf, 6, 0, sizeof(buf));
+  fsPwrite(fd, 0, 512, buf);
+  fsPwrite(fd, far, sizeof(buf), buf);
+  fsClose(fd);
+  remount();
+
+  fd = fsOpen("Sparse");
+  checkNum(20, "size", far + sizeof(buf), fsSize64(fd));
+  checkNum(20, "fsPread", sizeof(buf), fsPread(fd, far, sizeof(buf), rbuf));
+  checkStr(20, rbuf, 0, sizeof(buf), (char *)buf);
+  fsPread(fd, 0, 512, rbuf);
+  checkStr(20, rbuf, 0, 512, (char *)buf);
+
+  printf("The hole reads as zeros, before and beyond 2 GiB:\n");
+  memset(rbuf, 1, sizeof(rbuf));
+  fsPread(fd, 512, sizeof(rbuf), rbuf);
+  check(20, rbuf, 0, sizeof(rbuf), 0);
+  memset(rbuf, 1, sizeof(rbuf));
+  fsPread(fd, (2ll << 30) + 100, sizeof(rbuf), rbuf);
+  check(20, rbuf, 0, sizeof(rbuf), 0);
+  memset(rbuf, 1, sizeof(rbuf));
+  fsPread(fd, far - 100, 100, rbuf);
+  check(20, rbuf, 0, 100, 0);
+  fsClose(fd);
+
+  fsUnmount();
+}
+
+// ============================================================================
+// Return the # of blocks read or written, through the block cache or around
+// it, since the last bioResetStats
+// ============================================================================
+static i64 blockIO()
+{
+  BioStats stats;
+  bioGetStats(&stats);
+  return stats.hits + stats.misses + stats.reads + stats.writes;
+}
+
+// ============================================================================
+// TEST 21 : Delayed allocation.  Data written to new blocks is held in the
+// file's OFT entry, with no block IO at all: it reads back from there, and a
+// truncate drops the held blocks beyond EOF.  The blocks are written on the
+// last fsClose of the file - not while a second File Descriptor is still
+// open - or on fsSync
+// ============================================================================
+void test21()
+{
+  static i8 buf[20 * 512];
+  static i8 rbuf[20 * 512];
+
+  freshDisk((FsGeometry){512, 2000, 16});
+
+  printf("Held blocks read back, with no block IO:\n");
+  i32 fd = fsCreate("Held");
+  fillData(buf, 1, 0, 10 * 512);
+  bioResetStats();
+  fsWrite(fd, 10 * 512 - 100, buf); // whole blocks, then a partial one
+  fsPread(fd, 0, 10 * 512 - 100, rbuf);
+  checkNum(21, "block IO", 0, blockIO());
+  checkStr(21, rbuf, 0, 10 * 512 - 100, (char *)buf);
+
+  printf("Truncate over held blocks, then grow again:\n");
+  fsTruncate(fd, 3 * 512 + 100);
+  checkNum(21, "size", 3 * 512 + 100, fsSize64(fd));
+  fsPwrite(fd, 8 * 512, 512, buf + 8 * 512);
+  fsPread(fd, 0, 9 * 512, rbuf);
+  checkStr(21, rbuf, 0, 3 * 512 + 100, (char *)buf);
+  check(21, rbuf, 3 * 512 + 100, 5 * 512 - 100, 0);
+  checkStr(21, rbuf + 8 * 512, 0, 512, (char *)buf + 8 * 512);
+  fsClose(fd);
+  remount();
+  fd = fsOpen("Held");
+  fsPread(fd, 0, 9 * 512, rbuf);
+  checkStr(21, rbuf, 0, 3 * 512 + 100, (char *)buf);
+  check(21, rbuf, 3 * 512 + 100, 5 * 512 - 100, 0);
+  checkStr(21, rbuf + 8 * 512, 0, 512, (char *)buf + 8 * 512);
+  fsClose(fd);
+
+  printf("Written on the last fsClose, not while a second FD is open:\n");
+  i32 fd1 = fsCreate("Two");
+  i32 fd2 = fsOpen("Two");
+  fillData(buf, 2, 0, 4 * 512);
+  bioResetStats();
+  fsWrite(fd1, 4 * 512, buf);
+  fsClose(fd1);
+  checkNum(21, "block IO", 0, blockIO());
+  fsClose(fd2);
+  checkNum(21, "written", 1, blockIO() >= 4);
+  remount();
+  checkNum(21, "first bad byte", -1, diffFile("Two", 2, 4 * 512));
+
+  printf("fsSync writes the blocks of every open file:\n");
+  i32 fds[3];
+  char fname[FNAMESIZE];
+  bioResetStats();
+  for (i32 f = 0; f < 3; ++f)
+  {
+    sprintf(fname, "Sync%d", f);
+    fds[f] = fsCreate(fname);
+    fillData(buf, 10 + f, 0, 5 * 512);
+    fsWrite(fds[f], 5 * 512, buf);
+  }
+  i64 before = blockIO(); // only the Dir entries
+  fsSync();
+  checkNum(21, "written", 1, blockIO() - before >= 15);
+  for (i32 f = 0; f < 3; ++f)
+    fsClose(fds[f]);
+  remount();
+  for (i32 f = 0; f < 3; ++f)
+  {
+    sprintf(fname, "Sync%d", f);
+    checkNum(21, "first bad byte", -1, diffFile(fname, 10 + f, 5 * 512));
+  }
+
+  fsUnmount();
+}
+
+// ============================================================================
+// Create file 'fname', reserve 8 blocks for it with fsFallocate, write its
+// FBNs 'fbns' - 'count' of them, whole blocks of file number 'file' - and
+// close it
+// ============================================================================
+static void writeReserved(str fname, i32 file, i32 *fbns, i32 count)
+{
+  i8 buf[512];
+  i32 fd = fsCreate(fname);
+  fsFallocate(fd, 0, 8 * 512);
+  for (i32 i = 0; i < count; ++i)
+  {
+    fillData(buf, file, fbns[i] * 512, 512);
+    fsPwrite(fd, fbns[i] * 512, 512, buf);
+  }
+  fsClose(fd);
+}
+
+// ============================================================================
+// TEST 22 : fsFallocate on an extent disk.  Reserved blocks read as zeros,
+// and a partial write keeps the rest of its block zero.  Writes land on the
+// reserved blocks, even while another file is written in turn, so the file
+// stays one Extent.  A written block is cut out of the reserved Extent - off
+// its front, middle or end - and joins the written Extent before it
+// ============================================================================
+void test22()
+{
+  static i8 buf[20 * 512];
+  static i8 rbuf[20 * 512];
+
+  freshDisk((FsGeometry){512, 2000, 16, 1});
+
+  printf("Reserved blocks read as zeros:\n");
+  i32 fd = fsCreate("Zeros");
+  fsFallocate(fd, 0, 20 * 512);
+  checkNum(22, "size", 20 * 512, fsSize64(fd));
+  checkNum(22, "cursor", 0, fsTell(fd));
+  memset(rbuf, 1, sizeof(rbuf));
+  fsPread(fd, 0, 20 * 512, rbuf);
+  check(22, rbuf, 0, 20 * 512, 0);
+
+  printf("A partial write keeps the rest of its block zero:\n");
+  fillData(buf, 4, 0, 100);
+  fsPwrite(fd, 5 * 512 + 50, 100, buf);
+  fsClose(fd);
+  remount();
+  fd = fsOpen("Zeros");
+  fsPread(fd, 0, 20 * 512, rbuf);
+  check(22, rbuf, 0, 5 * 512 + 50, 0);
+  checkStr(22, rbuf + 5 * 512 + 50, 0, 100, (char *)buf);
+  check(22, rbuf, 5 * 512 + 150, 15 * 512 - 150, 0);
+  fsClose(fd);
+
+  printf("Writes land on the reserved blocks:\n");
+  i32 fdLand = fsCreate("Land");
+  fsFallocate(fdLand, 0, 8 * 512);
+  i32 fdOther = fsCreate("Other");
+  writeTurns(fdLand, 5, fdOther, 6, 8);
+  fsClose(fdLand);
+  fsClose(fdOther);
+  checkNum(22, "extents", 1, numExtents("Land"));
+  checkNum(22, "first bad byte", -1, diffFile("Land", 5, 8 * 512));
+
+  printf("Split off the front, the end, the middle, then join:\n");
+  i32 front[] = {0};
+  writeReserved("Front", 7, front, 1);
+  checkNum(22, "extents", 2, numExtents("Front"));
+  i32 end[] = {7};
+  writeReserved("End", 7, end, 1);
+  checkNum(22, "extents", 2, numExtents("End"));
+  i32 middle[] = {3};
+  writeReserved("Middle", 7, middle, 1);
+  checkNum(22, "extents", 3, numExtents("Middle"));
+  i32 join[] = {3, 4};
+  writeReserved("Join", 7, join, 2);
+  checkNum(22, "extents", 3, numExtents("Join"));
+
+  remount();
+  fd = fsOpen("Join");
+  fsPread(fd, 0, 8 * 512, rbuf);
+  fillData(buf, 7, 3 * 512, 2 * 512);
+  check(22, rbuf, 0, 3 * 512, 0);
+  checkStr(22, rbuf + 3 * 512, 0, 2 * 512, (char *)buf);
+  check(22, rbuf, 5 * 512, 3 * 512, 0);
+  fsClose(fd);
+
+  fsUnmount();
+}
+
+// ============================================================================
+// TEST 23 : fsDelete and fsTruncate, on a disk of 300 blocks.  Files of 200
+// blocks are written and deleted, over and over, which only fits if every
+// block - data, indirect tables and extent tree nodes - comes back each
+// time, also when the free space is fragmented.  A truncate frees the blocks
+// beyond the new EOF, and the file regrows with zeros in the gap.  An open
+// file, or a directory that holds files, cannot be deleted.  Names deleted
+// from the hashed Dir are gone, and can be created again
+// ============================================================================
+void test23()
+{
+  static i8 buf[512];
+  static i8 rbuf[191 * 512];
+  char fname[FNAMESIZE];
+
+  for (i32 extents = 0; extents <= 1; ++extents)
+  {
+    printf("Delete frees every block, %s:\n", extents ? "extents" : "pointers");
+    freshDisk((FsGeometry){512, 300, 16, extents});
+    for (i32 round = 0; round < 4; ++round)
+    {
+      writeFile("Big", round, 200 * 512);
+      checkNum(23, "fsDelete", 0, fsDelete("Big"));
+    }
+
+    printf("Delete frees fragmented space, %s:\n",
+           extents ? "extents" : "pointers");
+    for (i32 round = 0; round < 4; ++round)
+    {
+      i32 fd1 = fsCreate("Turns1");
+      i32 fd2 = fsCreate("Turns2");
+      writeTurns(fd1, round, fd2, round + 1, 70);
+      fsClose(fd1);
+      fsClose(fd2);
+      checkNum(23, "fsDelete", 0, fsDelete("Turns1"));
+      writeFile("Big", round, 140 * 512);
+      checkNum(23, "first bad byte", -1, diffFile("Big", round, 140 * 512));
+      checkNum(23, "fsDelete", 0, fsDelete("Turns2"));
+      checkNum(23, "fsDelete", 0, fsDelete("Big"));
+    }
+    fsUnmount();
+  }
+
+  printf("Truncate frees the blocks beyond EOF, then regrow:\n");
+  freshDisk((FsGeometry){512, 300, 16});
+  writeFile("Trunc", 5, 200 * 512);
+  i32 fd = fsOpen("Trunc");
+  fsTruncate(fd, 50 * 512 + 100);
+  checkNum(23, "size", 50 * 512 + 100, fsSize64(fd));
+  writeFile("After", 6, 200 * 512);
+  checkNum(23, "first bad byte", -1, diffFile("After", 6, 200 * 512));
+  checkNum(23, "fsDelete", 0, fsDelete("After"));
+  fillData(buf, 5, 190 * 512, 512);
+  fsPwrite(fd, 190 * 512, 512, buf);
+  fsClose(fd);
+  remount();
+  fd = fsOpen("Trunc");
+  checkNum(23, "size", 191 * 512, fsSize64(fd));
+  fsPread(fd, 0, 191 * 512, rbuf);
+  fillData(buf, 5, 0, 512);
+  checkStr(23, rbuf, 0, 512, (char *)buf);
+  fillData(buf, 5, 50 * 512, 100);
+  checkStr(23, rbuf + 50 * 512, 0, 100, (char *)buf);
+  check(23, rbuf, 50 * 512 + 100, 140 * 512 - 100, 0);
+  fillData(buf, 5, 190 * 512, 512);
+  checkStr(23, rbuf + 190 * 512, 0, 512, (char *)buf);
+
+  printf("An open file cannot be deleted:\n");
+  checkNum(23, "fsDelete", EFILEOPEN, fsDelete("Trunc"));
+  fsClose(fd);
+  checkNum(23, "fsDelete", 0, fsDelete("Trunc"));
+  checkNum(23, "fsDelete", EFNF, fsDelete("Trunc"));
+  checkNum(23, "fsOpen", EFNF, fsOpen("Trunc"));
+
+  printf("A directory that holds files cannot be deleted:\n");
+  fsMkdir("D");
+  writeVal("D/F", 1);
+  checkNum(23, "fsDelete", ENOTEMPTY, fsDelete("D"));
+  checkNum(23, "fsDelete", 0, fsDelete("D/F"));
+  checkNum(23, "fsDelete", 0, fsDelete("D"));
+  checkNum(23, "fsOpen", EFNF, fsOpen("D/F"));
+  fsUnmount();
+
+  printf("Names deleted from the Dir can be created again:\n");
+  freshDisk((FsGeometry){512, 2000, 64});
+  for (i32 f = 0; f < 40; ++f)
+  {
+    sprintf(fname, "Re%d", f);
+    writeVal(fname, f);
+  }
+  for (i32 f = 0; f < 40; f += 2)
+  {
+    sprintf(fname, "Re%d", f);
+    fsDelete(fname);
+  }
+  i32 gone = 0;
+  i32 found = 0;
+  for (i32 f = 0; f < 40; ++f)
+  {
+    sprintf(fname, "Re%d", f);
+    if (f % 2 == 0)
+      gone += (readVal(fname) == EFNF);
+    else
+      found += (readVal(fname) == f);
+  }
+  checkNum(23, "files gone", 20, gone);
+  checkNum(23, "files found", 20, found);
+  for (i32 f = 0; f < 40; f += 2)
+  {
+    sprintf(fname, "Re%d", f);
+    writeVal(fname, 100 + f);
+  }
+  remount();
+  found = 0;
+  for (i32 f = 0; f < 40; ++f)
+  {
+    sprintf(fname, "Re%d", f);
+    found += (readVal(fname) == ((f % 2 == 0) ? 100 + f : f));
+  }
+  checkNum(23, "files found", 40, found);
+
+  fsUnmount();
+}
+
+// ============================================================================
+// TEST 24 : Punching holes.  Zeros written over a run of BIOPUNCHRUN or more
+// blocks of a file are punched out of FSTESTDISK, and a shorter run is
+// written.  Zeros written to a hole take no block.  Blocks freed while dirty
+// in the cache are never written back.  If the host cannot punch holes,
+// every run is written instead
+// ============================================================================
+void test24()
+{
+  static i8 buf[64 * 512];
+  static i8 rbuf[64 * 512];
+  BioStats stats;
+
+  bioSetCacheSize(256);
+  freshDisk((FsGeometry){512, 2000, 16});
+
+  printf("Zeros over a run of BIOPUNCHRUN blocks are punched:\n");
+  writeFile("Punch", 8, 2 * BIOPUNCHRUN * 512);
+  fsSync();
+  memset(buf, 0, sizeof(buf));
+  i32 fd = fsOpen("Punch");
+  bioResetStats();
+  fsPwrite(fd, 0, BIOPUNCHRUN * 512, buf);
+  fsSync();
+  bioGetStats(&stats);
+  if (stats.punched == 0) // the host cannot punch holes: all written instead
+    printf("Note: no hole punching on this host \n");
+  checkNum(24, "punched", stats.punched ? BIOPUNCHRUN : 0, stats.punched);
+  checkNum(24, "writes", stats.punched ? 0 : BIOPUNCHRUN, stats.writes);
+
+  printf("Zeros over a shorter run are written:\n");
+  bioResetStats();
+  fsPwrite(fd, BIOPUNCHRUN * 512, (BIOPUNCHRUN - 1) * 512, buf);
+  fsSync();
+  bioGetStats(&stats);
+  checkNum(24, "punched", 0, stats.punched);
+  checkNum(24, "writes", BIOPUNCHRUN - 1, stats.writes);
+  fsClose(fd);
+  remount();
+  fd = fsOpen("Punch");
+  memset(rbuf, 1, sizeof(rbuf));
+  fsPread(fd, 0, 2 * BIOPUNCHRUN * 512, rbuf);
+  check(24, rbuf, 0, (2 * BIOPUNCHRUN - 1) * 512, 0);
+  fillData(buf, 8, (2 * BIOPUNCHRUN - 1) * 512, 512);
+  checkStr(24, rbuf + (2 * BIOPUNCHRUN - 1) * 512, 0, 512, (char *)buf);
+  fsClose(fd);
+
+  printf("Zeros written to a hole take no block:\n");
+  memset(buf, 0, sizeof(buf));
+  fd = fsCreate("Zero");
+  bioResetStats();
+  fsWrite(fd, 64 * 512, buf);
+  fsClose(fd);
+  fsSync();
+  bioGetStats(&stats);
+  checkNum(24, "writes < 4", 1, stats.writes < 4);
+  fd = fsOpen("Zero");
+  checkNum(24, "size", 64 * 512, fsSize64(fd));
+  memset(rbuf, 1, sizeof(rbuf));
+  fsPread(fd, 0, 64 * 512, rbuf);
+  check(24, rbuf, 0, 64 * 512, 0);
+  fsClose(fd);
+
+  printf("Freed blocks dirty in the cache are not written back:\n");
+  writeFile("Freed", 9, 64 * 512);
+  fsSync();
+  fd = fsOpen("Freed");
+  fillData(buf, 10, 0, 64);
+  for (i32 fbn = 0; fbn < 64; ++fbn)
+    fsPwrite(fd, fbn * 512 + 100, 64, buf); // dirty the cached block
+  bioResetStats();
+  fsTruncate(fd, 0);
+  fsSync();
+  bioGetStats(&stats);
+  checkNum(24, "writes < 8", 1, stats.writes < 8);
+  checkNum(24, "punched", 1, stats.punched == 0 || stats.punched >= 64);
+  fsClose(fd);
+
+  fsUnmount();
+  bioSetCacheSize(BIOCACHEBLOCKS);
+}
+
+// ============================================================================
+// Run the checks on FSTESTDISK, then remove it, and go back to BFSDISK
+// ============================================================================
+void fstest()
+{
+  fsSetDisk(FSTESTDISK);
+
+  test13();
+  test14();
+  test15();
+  test16();
+  test17();
+  test18();
+  test19();
+  test20();
+  test21();
+  test22();
+  test23();
+  test24();
+
+  remove(FSTESTDISK);
+  fsSetDisk(BFSDISK);
+}
@@ -2,11 +2,15 @@
 
 #include "bfs.h"
 #include "errors.h"
+#include "fs.h"
 #include "p5test.h"
 
 int main()
 {
   bfsInitOFT();
+  fstest(); // on a scratch disk of its own
+  fsMount();
   p5test();
+  fsUnmount();
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,245 @@
+// ============================================================================
+// mtbench.c : multi-threaded benchmark of the BFS filesystem.  Times threads
+// reading files of their own with fsRead, then threads reading one shared
+// file with fsPread, at 1, 2, 4 and 8 threads, while checking every byte
+// read.  A final round mixes readers with writers of other files.
+//
+// Build: gcc -O2 -pthread -o mtbench mtbench.c bfs.c bio.c fs.c errors.c deb.c
+// It formats MTBENCHDISK, a scratch disk of its own, and removes it at the end
+// ============================================================================
+
+#include <pthread.h>
+#include <time.h>
+
+#include "bfs.h"
+#include "fs.h"
+
+#define MTBENCHDISK "MTBENCH.BFS" // scratch disk, removed at the end
+
+#define MAXTHREADS 8
+#define FILEBLOCKS 2048         // blocks in each file, well past NUMMAPFBN
+#define CHUNK      (64 * 1024)  // bytes per fsRead
+#define PREADSIZE  4096         // bytes per fsPread
+#define PASSES     8            // times each reader reads its file
+
+typedef struct
+{               // Work for one thread
+  i32 id;       // 0, 1, ...
+  i32 fd;       // File Descriptor it uses
+  i32 file;     // file number: the data it expects
+  i64 numb;     // bytes read or written
+  i32 bad;      // # of mismatches found
+} Job;
+
+static i64 g_fileSize;
+
+// ============================================================================
+// Return the byte expected at 'offset' in file 'file'
+// ============================================================================
+static i8 expected(i32 file, i64 offset)
+{
+  return (i8)(file * 31 + offset / 512 + offset % 7);
+}
+
+// ============================================================================
+// Fill 'buf' with the 'numb' bytes of file 'file' that start at 'offset'
+// ============================================================================
+static void fill(i8 *buf, i32 file, i64 offset, i64 numb)
+{
+  for (i64 i = 0; i < numb; ++i)
+    buf[i] = expected(file, offset + i);
+}
+
+// ============================================================================
+// Count the bytes of 'buf' that differ from file 'file' at 'offset'
+// ============================================================================
+static i32 verify(i8 *buf, i32 file, i64 offset, i64 numb)
+{
+  i32 bad = 0;
+  for (i64 i = 0; i < numb; ++i)
+    bad += (buf[i] != expected(file, offset + i));
+  return bad;
+}
+
+// ============================================================================
+// Return seconds since an arbitrary start
+// ============================================================================
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// ============================================================================
+// Thread: read its own file from start to end, PASSES times, with fsRead
+// ============================================================================
+static void *readOwn(void *arg)
+{
+  Job *job = arg;
+  static __thread i8 buf[CHUNK];
+  for (i32 pass = 0; pass < PASSES; ++pass)
+  {
+    fsSeek(job->fd, 0, SEEK_SET);
+    for (i64 pos = 0; pos < g_fileSize; pos += CHUNK)
+    {
+      i32 numb = fsRead(job->fd, CHUNK, buf);
+      job->bad += verify(buf, job->file, pos, numb);
+      job->numb += numb;
+    }
+  }
+  return NULL;
+}
+
+// ============================================================================
+// Thread: read random ranges of the shared file with fsPread, on the File
+// Descriptor every thread shares
+// ============================================================================
+static void *readShared(void *arg)
+{
+  Job *job = arg;
+  i8 buf[PREADSIZE];
+  u32 seed = 12345 + job->id;
+  i64 count = PASSES * g_fileSize / PREADSIZE;
+  for (i64 i = 0; i < count; ++i)
+  {
+    seed = seed * 1103515245 + 12345;
+    i64 offset = (i64)(seed >> 8) % (g_fileSize - PREADSIZE);
+    i64 numb = fsPread(job->fd, offset, PREADSIZE, buf);
+    job->bad += verify(buf, job->file, offset, numb);
+    job->numb += numb;
+  }
+  return NULL;
+}
+
+// ============================================================================
+// Thread: rewrite its own file, with the same data, using fsPwrite
+// ============================================================================
+static void *writeOwn(void *arg)
+{
+  Job *job = arg;
+  static __thread i8 buf[CHUNK];
+  for (i64 pos = 0; pos < g_fileSize; pos += CHUNK)
+  {
+    fill(buf, job->file, pos, CHUNK);
+    fsPwrite(job->fd, pos, CHUNK, buf);
+    job->numb += CHUNK;
+  }
+  return NULL;
+}
+
+// ============================================================================
+// Run 'numThreads' threads on 'jobs', and report their throughput, and the
+// speedup over 'base' MB/s, if given.  Add the # of mismatches they found to
+// 'bad'.  Return the throughput, in MB/s
+// ============================================================================
+static double run(str name, void *(*body)(void *), Job *jobs, i32 numThreads,
+                  double base, i32 *bad)
+{
+  pthread_t tid[MAXTHREADS];
+  double start = now();
+  for (i32 t = 0; t < numThreads; ++t)
+    pthread_create(&tid[t], NULL, body, &jobs[t]);
+  for (i32 t = 0; t < numThreads; ++t)
+    pthread_join(tid[t], NULL);
+  double secs = now() - start;
+
+  i64 numb = 0;
+  i32 numBad = 0;
+  for (i32 t = 0; t < numThreads; ++t)
+  {
+    numb += jobs[t].numb;
+    numBad += jobs[t].bad;
+  }
+  double mbs = numb / secs / (1 << 20);
+  printf("%-12s threads = %d  %8.1f MB/s", name, numThreads, mbs);
+  if (base > 0)
+    printf("  x%.2f", mbs / base);
+  printf("%s\n", numBad ? "  BAD" : "");
+  fflush(stdout);
+
+  *bad += numBad;
+  return mbs;
+}
+
+int main()
+{
+  FsGeometry geo = {4096, FILEBLOCKS * MAXTHREADS + 200, 16, 1};
+  bioSetCacheSize(FILEBLOCKS * MAXTHREADS + 64); // every file stays cached
+  fsSetDisk(MTBENCHDISK);
+  fsFormat(&geo);
+  fsMount();
+
+  g_fileSize = (i64)FILEBLOCKS * 4096;
+  char fname[FNAMESIZE];
+  i32 fds[MAXTHREADS];
+  static i8 buf[CHUNK];
+  for (i32 f = 0; f < MAXTHREADS; ++f)
+  {
+    sprintf(fname, "F%d", f);
+    fds[f] = fsCreate(fname);
+    for (i64 pos = 0; pos < g_fileSize; pos += CHUNK)
+    {
+      fill(buf, f, pos, CHUNK);
+      fsWrite(fds[f], CHUNK, buf);
+    }
+  }
+
+  Job jobs[MAXTHREADS];
+  i32 bad = 0;
+
+  // Each thread reads a file of its own
+
+  double base = 0;
+  for (i32 n = 1; n <= MAXTHREADS; n *= 2)
+  {
+    for (i32 t = 0; t < n; ++t)
+      jobs[t] = (Job){t, fds[t], t, 0, 0};
+    double mbs = run("own files", readOwn, jobs, n, base, &bad);
+    if (n == 1)
+      base = mbs;
+  }
+
+  // Every thread reads file 0, through one File Descriptor
+
+  printf("\n");
+  base = 0;
+  for (i32 n = 1; n <= MAXTHREADS; n *= 2)
+  {
+    for (i32 t = 0; t < n; ++t)
+      jobs[t] = (Job){t, fds[0], 0, 0, 0};
+    double mbs = run("shared file", readShared, jobs, n, base, &bad);
+    if (n == 1)
+      base = mbs;
+  }
+
+  // Readers of half the files, writers of the other half.  The writers write
+  // back what the files already hold, so every file is then checked whole
+
+  printf("\n");
+  pthread_t tid[MAXTHREADS];
+  for (i32 t = 0; t < MAXTHREADS; ++t)
+  {
+    jobs[t] = (Job){t, fds[t], t, 0, 0};
+    pthread_create(&tid[t], NULL, (t % 2) ? writeOwn : readOwn, &jobs[t]);
+  }
+  for (i32 t = 0; t < MAXTHREADS; ++t)
+  {
+    pthread_join(tid[t], NULL);
+    bad += jobs[t].bad;
+  }
+  for (i32 f = 0; f < MAXTHREADS; ++f)
+  {
+    for (i64 pos = 0; pos < g_fileSize; pos += CHUNK)
+    {
+      fsPread(fds[f], pos, CHUNK, buf);
+      bad += verify(buf, f, pos, CHUNK);
+    }
+    fsClose(fds[f]);
+  }
+  printf("mixed        threads = %d  %s\n", MAXTHREADS, bad ? "BAD" : "GOOD");
+
+  fsUnmount();
+  remove(MTBENCHDISK);
+  return bad != 0;
+}
@@ -53,6 +53,23 @@ void checkCursor(int testnum, int expected, int actual)
   }
 }
 
+// ============================================================================
+// Check that 'actual' == 'expected' for test 'testnum'.  'what' names the
+// value - used for reporting
+// ============================================================================
+void checkNum(int testnum, str what, i64 expected, i64 actual)
+{
+  if (actual == expected)
+  {
+    printf("TEST %d : GOOD \n", testnum);
+  }
+  else
+  {
+    printf("TEST %d : BAD  : %s = %lld but should be %lld \n",
+           testnum, what, (long long)actual, (long long)expected);
+  }
+}
+
 // ============================================================================
 // Create file "P5", holding 50 blocks, inside of BFSDISK, and populate
 // ============================================================================
@@ -299,8 +316,6 @@ void test8()
   buf[0] = 'A';
   fsWrite(fd, 512, buf);
 
-  fsClose(fd);
-
   fsSeek(fd, 0, SEEK_SET);
   i32 curs = fsTell(fd);
   checkCursor(8, 0, curs);
@@ -325,6 +340,8 @@ void test8()
   curs = fsTell(fd);
   checkCursor(8, 512, curs);
   check(8, rBuf, 0, 1, 'Z');
+
+  fsClose(fd);
 }
 
 void test9()
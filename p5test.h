@@ -9,16 +9,21 @@
 #include "fs.h"           // fsOpen, etc
 
 #define BLOCKS        50
+#ifndef BYTESPERBLOCK      // bfs.h sets it at mount; p5test files use 512
 #define BYTESPERBLOCK 512
+#endif
 #define BUFSIZE       2000
 
 void check(i32 testnum, i8* buf, i32 start, i32 size, i32 val);
+void checkStr(i32 testnum, i8* buf, i32 start, i32 size, char val[]);
 void checkCursor(i32 testnum, i32 expected, i32 actual);
+void checkNum(i32 testnum, str what, i64 expected, i64 actual);
 void createP5();
 void test1(i32 fd);
 void test2(i32 fd);
 void test3(i32 fd);
 void test4(i32 fd);
 void p5test();
+void fstest();
 
 #endif
\ No newline at end of file